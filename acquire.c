@@ -0,0 +1,967 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Acquisition engine
+ *
+ * Polls the thermometers and counters of one adapter. All state is
+ * kept in the owacq_t of the adapter. A cycle starts a temperature
+ * conversion on all thermometers at once with Skip ROM, waits for it
+ * to complete and then reads every device that is due.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "acquire.h"
+#include "ds18b20.h"
+#include "ds28ea00.h"
+#include "log.h"
+#include "probes.h"
+#include "util.h"
+
+#define OWCMD_CONVERT_T 0x44
+
+/*
+ * Transaction timing used by the planner until a read has been
+ * measured. A READ STRAIGHT costs a reset, the bytes on the wire and
+ * a few USB frames for the command, the status poll and the result.
+ */
+#define OWACQ_USB_OVERHEAD_NS 3000000
+#define OWACQ_RESET_NS 960000
+#define OWACQ_BIT_NS 65000
+#define OWACQ_OD_RESET_NS 96000
+#define OWACQ_OD_BIT_NS 10000
+
+void
+owtime_now(owtime_t *t)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t->mono = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->wall = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The time halfway between a and b */
+static void
+owtime_mid(owtime_t *t, const owtime_t *a, const owtime_t *b)
+{
+	t->mono = a->mono + (b->mono - a->mono) / 2;
+	t->wall = a->wall + (b->wall - a->wall) / 2;
+}
+
+static int
+owacq_type(uint8_t family)
+{
+	switch (family) {
+	case DS18B20_FAMILY:
+	case 0x22: /* DS1822 */
+	case DS28EA00_FAMILY:
+		return OWACQ_THERMOMETER;
+	case DS2423_FAMILY:
+		return OWACQ_COUNTER;
+	}
+	return 0;
+}
+
+void
+owacq_init(owacq_t *a, owusb_device_t *dev)
+{
+	memset(a, 0, sizeof(*a));
+	a->dev = dev;
+	a->speed = PARAM_SPEED_REGULAR;
+	a->convert_time = OWACQ_CONVERT_MS * 1000000ULL;
+	a->slow_interval = OWACQ_SLOW_INTERVAL_MS * 1000000ULL;
+	a->slow_budget = OWACQ_SLOW_BUDGET;
+	a->retry_budget = OWACQ_RETRY_BUDGET;
+	a->slow_retry_budget = OWACQ_SLOW_RETRY_BUDGET;
+	a->batch = 1;
+}
+
+/*
+ * Add a device to be polled. Devices are polled in the order they are
+ * added.
+ *
+ * Returns: index of the device, < 0 if the family is not supported or
+ * there is no room left
+ */
+
+int
+owacq_add(owacq_t *a, const uint8_t *addr)
+{
+	owacq_dev_t *d;
+	int type;
+
+	type = owacq_type(addr[0]);
+	if (type == 0 || a->ndevs >= OWACQ_MAX_DEVS) {
+		return -1;
+	}
+	d = &a->devs[a->ndevs];
+	memset(d, 0, sizeof(*d));
+	memcpy(d->addr, addr, 8);
+	d->type = type;
+	d->slowdown = 1;
+	d->health = 1;
+	owacq_set_deadband(a, a->ndevs, -1, 0);
+	if (type == OWACQ_COUNTER) {
+		ds2423_init(&d->counter, addr, DS2423_CHANNEL_A | DS2423_CHANNEL_B);
+	}
+	return a->ndevs++;
+}
+
+/*
+ * Set the same deadband for all values of a device.
+ *
+ * @param i Index of the device
+ * @param deadband Minimum change to publish, < 0 to publish all
+ * @param max_silence Publish at least this often (ns), 0 for never
+ */
+
+void
+owacq_set_deadband(owacq_t *a, int i, double deadband, uint64_t max_silence)
+{
+	int j;
+
+	for (j = 0; j < OWACQ_MAX_VALUES; j++) {
+		a->devs[i].deadband[j] = deadband;
+	}
+	a->devs[i].max_silence = max_silence;
+}
+
+/*
+ * Let the read interval of a device follow how fast its signal
+ * changes: the temperature of thermometers and the rate of counter A
+ * of counters. The interval starts at min_interval.
+ *
+ * @param i Index of the device
+ * @param min_interval Shortest interval in ns
+ * @param max_interval Longest interval in ns, 0 to read every cycle
+ * @param threshold Change between two reads considered fast
+ */
+
+void
+owacq_set_adaptive(owacq_t *a, int i, uint64_t min_interval,
+		   uint64_t max_interval, double threshold)
+{
+	owacq_dev_t *d = &a->devs[i];
+
+	d->min_interval = min_interval;
+	d->max_interval = max_interval;
+	d->interval = min_interval;
+	d->threshold = threshold;
+	d->next_due = 0;
+}
+
+/* Interval a device is actually read at */
+static uint64_t
+owacq_interval(owacq_t *a, owacq_dev_t *d)
+{
+	uint64_t interval = (d->max_interval ? d->interval : a->period) * d->slowdown;
+
+	if (d->slow && interval < a->slow_interval) {
+		return a->slow_interval;
+	}
+	return interval;
+}
+
+uint64_t
+owacq_read_interval(owacq_t *a, int i)
+{
+	return owacq_interval(a, &a->devs[i]);
+}
+
+/* Bus time of one transaction writing and reading len bytes in total */
+static uint64_t
+owacq_transaction(owacq_t *a, int len)
+{
+	if (a->speed == PARAM_SPEED_OVERDIRVE) {
+		return OWACQ_USB_OVERHEAD_NS + OWACQ_OD_RESET_NS + len * 8 * OWACQ_OD_BIT_NS;
+	}
+	return OWACQ_USB_OVERHEAD_NS + OWACQ_RESET_NS + len * 8 * OWACQ_BIT_NS;
+}
+
+/*
+ * Bus time of reading a device: the measured cost once it has been
+ * read, otherwise what its transactions take on the wire. A counter
+ * is read with one transaction per channel.
+ */
+
+static uint64_t
+owacq_model_cost(owacq_t *a, owacq_dev_t *d)
+{
+	if (d->type == OWACQ_THERMOMETER) {
+		return owacq_transaction(a, 10 + DS18B20_SCRATCHPAD_LEN);
+	}
+	return DS2423_COUNTERS * owacq_transaction(a, 12 + 11);
+}
+
+uint64_t
+owacq_cost(owacq_t *a, int i)
+{
+	owacq_dev_t *d = &a->devs[i];
+
+	return d->cost ? d->cost : owacq_model_cost(a, d);
+}
+
+/*
+ * Fraction of the bus time used by the current intervals, based on
+ * the measured cost of each read. Devices read every cycle are only
+ * counted when the cycle period is known.
+ */
+
+double
+owacq_load(owacq_t *a)
+{
+	double load = 0;
+	uint64_t interval;
+	int i;
+
+	for (i = 0; i < a->ndevs; i++) {
+		interval = owacq_interval(a, &a->devs[i]);
+		if (interval) {
+			load += (double)a->devs[i].cost / interval;
+		}
+	}
+	return load;
+}
+
+static int
+owacq_due(owacq_t *a, owacq_dev_t *d, uint64_t now)
+{
+	/* Half a period of slack keeps the grid from delaying a read a full cycle */
+	return (d->max_interval == 0 && d->slowdown == 1 && !d->slow) ||
+		now + a->period / 2 >= d->next_due;
+}
+
+/*
+ * Compute the bus time needed per cycle period with the current
+ * intervals. a->period must be set.
+ */
+
+void
+owacq_capacity(owacq_t *a, owacq_capacity_t *c)
+{
+	uint64_t interval;
+	uint64_t fastest = 0;
+	double limit = a->budget ? a->budget : 1;
+	int i;
+
+	memset(c, 0, sizeof(*c));
+	c->period = a->period;
+	for (i = 0; i < a->ndevs; i++) {
+		if (a->devs[i].slowdown > 1) {
+			c->degraded++;
+		}
+		interval = owacq_interval(a, &a->devs[i]);
+		if (interval == 0) {
+			continue;
+		}
+		c->reads += owacq_cost(a, i) * a->period / interval;
+		if (a->devs[i].type == OWACQ_THERMOMETER &&
+		    (fastest == 0 || interval < fastest)) {
+			fastest = interval;
+		}
+	}
+	/* A conversion is run whenever the most frequent thermometer is due */
+	if (fastest) {
+		c->convert = (a->convert_time + owacq_transaction(a, 2)) *
+			a->period / fastest;
+	}
+	if (a->period) {
+		c->utilisation = (double)(c->convert + c->reads) / a->period;
+	}
+	c->headroom = limit - c->utilisation;
+}
+
+/*
+ * Fit the devices into the bus time. When the demand exceeds the
+ * budget, or the whole period without a budget, the devices of the
+ * lowest priority are slowed down step by step, each step doubling
+ * their interval, up to OWACQ_MAX_SLOWDOWN. Devices of the highest
+ * priority present are never slowed down. Any earlier slowdown is
+ * undone first, so the plan can be redone when the costs change.
+ *
+ * @param c Filled in with the resulting capacity, may be NULL
+ *
+ * Returns: number of devices slowed down, or -1 if the devices do not
+ * fit even when slowed down
+ */
+
+int
+owacq_plan(owacq_t *a, owacq_capacity_t *c)
+{
+	owacq_capacity_t cap;
+	int lowest, highest;
+	int prio, next;
+	int changed;
+	int i;
+
+	if (c == NULL) {
+		c = &cap;
+	}
+	for (i = 0; i < a->ndevs; i++) {
+		a->devs[i].slowdown = 1;
+	}
+	if (a->ndevs == 0) {
+		owacq_capacity(a, c);
+		return 0;
+	}
+	lowest = highest = a->devs[0].priority;
+	for (i = 1; i < a->ndevs; i++) {
+		if (a->devs[i].priority < lowest) lowest = a->devs[i].priority;
+		if (a->devs[i].priority > highest) highest = a->devs[i].priority;
+	}
+
+	prio = lowest;
+	owacq_capacity(a, c);
+	while (c->headroom < 0 && prio < highest) {
+		changed = 0;
+		for (i = 0; i < a->ndevs; i++) {
+			if (a->devs[i].priority <= prio &&
+			    a->devs[i].slowdown < OWACQ_MAX_SLOWDOWN) {
+				a->devs[i].slowdown *= 2;
+				changed = 1;
+			}
+		}
+		/* Fully slowed down, include the next priority */
+		if (!changed) {
+			next = highest;
+			for (i = 0; i < a->ndevs; i++) {
+				if (a->devs[i].priority > prio && a->devs[i].priority < next) {
+					next = a->devs[i].priority;
+				}
+			}
+			prio = next;
+		}
+		owacq_capacity(a, c);
+	}
+	return c->headroom < 0 ? -1 : c->degraded;
+}
+
+static void
+owacq_adapt(owacq_t *a, owacq_dev_t *d)
+{
+	owacq_reading_t *r = &d->reading;
+	uint64_t faster;
+	double load;
+	double v, change;
+
+	if (d->max_interval == 0 || r->status != 0) {
+		return;
+	}
+	v = r->value[d->type == OWACQ_COUNTER ? 2 : 0];
+	change = v > d->last_value ? v - d->last_value : d->last_value - v;
+	if (d->has_last && change > d->threshold) {
+		faster = d->interval / 2;
+		if (faster < d->min_interval) {
+			faster = d->min_interval;
+		}
+		/* Only speed up if the bus has time left for it */
+		load = owacq_load(a) - (double)d->cost / d->interval + (double)d->cost / faster;
+		if (a->budget == 0 || load <= a->budget) {
+			d->interval = faster;
+		}
+	} else if (d->has_last && change < d->threshold / 4) {
+		d->interval += d->interval / 4;
+		if (d->interval > d->max_interval) {
+			d->interval = d->max_interval;
+		}
+	}
+	d->last_value = v;
+	d->has_last = 1;
+}
+
+/*
+ * Search the bus and add all supported devices.
+ *
+ * Returns: number of devices added, < 0 on failure
+ */
+
+int
+owacq_discover(owacq_t *a)
+{
+	uint8_t roms[OWACQ_MAX_DEVS][8];
+	int len;
+	int i;
+	int n = 0;
+
+	len = owusb_search(a->dev, WIRE_CMD_SEARCH_ROM, (uint8_t *)roms, sizeof(roms));
+	if (len < 0) {
+		return len;
+	}
+	for (i = 0; i < len / 8; i++) {
+		if (owacq_add(a, roms[i]) >= 0) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Which classes of failures are retried, by OWACQ_ERR_* */
+static const uint8_t owacq_retryable[OWACQ_ERR_CLASSES] = {
+	0, /* NONE */
+	1, /* IO */
+	1, /* CRC */
+	1, /* APP */
+	0, /* NRS */
+	0, /* SH */
+	0  /* CANCEL */
+};
+
+/* Classify a failed transaction from the result codes of the adapter */
+static int
+owacq_classify(owacq_t *a, int status)
+{
+	uint16_t result;
+
+	if (status == OWUSB_ECANCEL) {
+		return OWACQ_ERR_CANCEL;
+	}
+	owusb_interrupt_read(a->dev);
+	result = owusb_result(a->dev);
+	if (result & RESULT_SH) {
+		return OWACQ_ERR_SH;
+	}
+	if (result & RESULT_NRS) {
+		return OWACQ_ERR_NRS;
+	}
+	if (result & RESULT_APP) {
+		return OWACQ_ERR_APP;
+	}
+	if (status == OWUSB_ECRC || (result & RESULT_CRC)) {
+		return OWACQ_ERR_CRC;
+	}
+	return OWACQ_ERR_IO;
+}
+
+/*
+ * Decide whether to retry a failed attempt, counting it against the
+ * cycle budget of its lane.
+ *
+ * @param used Retries used so far this cycle in the lane
+ * @param budget Retries allowed per cycle in the lane
+ * @param tries Retries of the transaction so far
+ */
+static int
+owacq_retry(owacq_t *a, int error, int *used, int budget, int tries)
+{
+	a->errors[error]++;
+	if (!owacq_retryable[error] || tries >= OWACQ_MAX_RETRIES || *used >= budget) {
+		owlog(OWLOG_DEBUG, "error class %ld not retried, try %ld, %ld of %ld retries used",
+		      error, tries, *used, budget);
+		OWPROBE4(retry, a->dev - owusb_devs, error, tries, 0);
+		return 0;
+	}
+	(*used)++;
+	a->retries++;
+	owlog(OWLOG_DEBUG, "retrying after error class %ld", error);
+	OWPROBE4(retry, a->dev - owusb_devs, error, tries, 1);
+	return 1;
+}
+
+/*
+ * Close the windows that have elapsed by the start of the cycle, so a
+ * device that stops answering gets its last window completed, and an
+ * empty one after that, instead of keeping a stale window.
+ */
+static void
+owacq_close_windows(owacq_t *a)
+{
+	owacq_agg_t *w;
+	uint64_t start;
+	int i;
+
+	if (a->window == 0) {
+		return;
+	}
+	start = a->convert.wall - a->convert.wall % a->window;
+	for (i = 0; i < a->ndevs; i++) {
+		w = &a->devs[i].window;
+		if (w->start == start) {
+			continue;
+		}
+		if (w->count) {
+			a->devs[i].completed = *w;
+		} else {
+			a->devs[i].completed.start = start - a->window;
+			a->devs[i].completed.count = 0;
+		}
+		w->start = start;
+		w->count = 0;
+	}
+}
+
+/*
+ * Start a temperature conversion on all thermometers, unless none of
+ * them is due this cycle. The conversion time is taken when the
+ * Convert T command has been sent. This starts a new cycle, so the
+ * retry budgets are renewed and elapsed aggregation windows closed.
+ */
+
+int
+owacq_convert(owacq_t *a)
+{
+	static const uint8_t cmd[] = { WIRE_CMD_SKIP_ROM, OWCMD_CONVERT_T };
+	uint64_t now = monotonic_ns();
+	uint64_t t;
+	int tries = 0;
+	int r = 0;
+	int i;
+
+	a->cycle_retries = 0;
+	a->cycle_retry_time = 0;
+	a->converting = 0;
+	for (i = 0; i < a->ndevs; i++) {
+		if (a->devs[i].type == OWACQ_THERMOMETER && owacq_due(a, &a->devs[i], now)) {
+			a->converting = 1;
+			break;
+		}
+	}
+	while (a->converting) {
+		t = monotonic_ns();
+		r = owusb_block_io(a->dev, cmd, sizeof(cmd), NULL, 0, 1, 0);
+		if (tries) {
+			a->cycle_retry_time += monotonic_ns() - t;
+		}
+		if (r == 0 || !owacq_retry(a, owacq_classify(a, r),
+					   &a->cycle_retries, a->retry_budget, tries++)) {
+			break;
+		}
+	}
+	owtime_now(&a->convert);
+	a->retry_time += a->cycle_retry_time;
+	owacq_close_windows(a);
+	return r;
+}
+
+/*
+ * Wait until the conversion has completed, which is signalled by the
+ * thermometers reading back 1 bits.
+ *
+ * Returns: 0 when done, OWUSB_EIO on timeout
+ */
+
+int
+owacq_wait_convert(owacq_t *a)
+{
+	uint64_t end = monotonic_ns() + OWACQ_CONVERT_TIMEOUT_MS * 1000000ULL;
+	unsigned gen = a->dev->cancel_gen;
+
+	if (!a->converting) {
+		return 0;
+	}
+	while (owusb_read_bit(a->dev) == 0) {
+		if (a->dev->cancel_gen != gen) {
+			return OWUSB_ECANCEL;
+		}
+		if (monotonic_ns() > end) {
+			return OWUSB_EIO;
+		}
+		usleep(10000);
+	}
+	return 0;
+}
+
+static void
+owacq_thermometer_value(owacq_t *a, owacq_dev_t *d, int status, const uint8_t *sp)
+{
+	owacq_reading_t *r = &d->reading;
+
+	r->status = status;
+	r->convert = a->convert;
+	if (r->status == 0) {
+		r->nvalues = 1;
+		r->value[0] = ds18b20_temp(sp);
+	}
+}
+
+static void
+owacq_read_thermometer(owacq_t *a, owacq_dev_t *d)
+{
+	uint8_t sp[DS18B20_SCRATCHPAD_LEN];
+	owtime_t start, end;
+	int status;
+
+	owtime_now(&start);
+	status = ds18b20_read_scratchpad(a->dev, d->addr, sp);
+	owtime_now(&end);
+	owtime_mid(&d->reading.read, &start, &end);
+	owacq_thermometer_value(a, d, status, sp);
+}
+
+static void
+owacq_read_counter(owacq_t *a, owacq_dev_t *d)
+{
+	owacq_reading_t *r = &d->reading;
+	ds2423_t *c = &d->counter;
+	owtime_t start, end;
+	int i;
+
+	owtime_now(&start);
+	r->status = ds2423_sample(a->dev, c);
+	owtime_now(&end);
+	owtime_mid(&r->read, &start, &end);
+	r->convert = r->read;
+	if (r->status < 0) {
+		return;
+	}
+	r->status = 0;
+	r->nvalues = 2 + DS2423_COUNTERS;
+	for (i = 0; i < DS2423_COUNTERS; i++) {
+		r->value[i] = c->count[i];
+		r->value[2 + i] = c->valid[i] == 2 ? c->rate[i] : 0;
+	}
+}
+
+static void
+owacq_aggregate(owacq_t *a, owacq_dev_t *d)
+{
+	owacq_reading_t *r = &d->reading;
+	owacq_agg_t *w = &d->window;
+	uint64_t start;
+	int i;
+
+	if (a->window == 0 || r->status != 0) {
+		return;
+	}
+	start = r->convert.wall - r->convert.wall % a->window;
+	if (w->count && start != w->start) {
+		d->completed = *w;
+		w->count = 0;
+	}
+	if (w->count == 0) {
+		w->start = start;
+		w->nvalues = r->nvalues;
+		for (i = 0; i < r->nvalues; i++) {
+			w->min[i] = w->max[i] = r->value[i];
+			w->sum[i] = 0;
+		}
+	}
+	for (i = 0; i < w->nvalues; i++) {
+		if (r->value[i] < w->min[i]) w->min[i] = r->value[i];
+		if (r->value[i] > w->max[i]) w->max[i] = r->value[i];
+		w->sum[i] += r->value[i];
+		w->last[i] = r->value[i];
+	}
+	w->count++;
+}
+
+/*
+ * Copy the aggregates of all devices, in device order. The mean of a
+ * value is its sum divided by the count.
+ *
+ * @param out Array of at least n entries
+ * @param completed 1 for the last completed windows, 0 for the
+ * windows in progress
+ *
+ * Returns: number of entries copied
+ */
+
+int
+owacq_aggregates(owacq_t *a, owacq_agg_t *out, int n, int completed)
+{
+	int i;
+
+	for (i = 0; i < a->ndevs && i < n; i++) {
+		out[i] = completed ? a->devs[i].completed : a->devs[i].window;
+	}
+	return i;
+}
+
+static int
+owacq_significant(owacq_dev_t *d)
+{
+	owacq_reading_t *r = &d->reading;
+	owacq_reading_t *p = &d->published;
+	double delta;
+	int i;
+
+	if (!d->has_published || r->status != p->status) {
+		return 1;
+	}
+	if (d->max_silence && r->read.mono - p->read.mono >= d->max_silence) {
+		return 1;
+	}
+	if (r->status != 0) {
+		return 0;
+	}
+	for (i = 0; i < r->nvalues; i++) {
+		delta = r->value[i] - p->value[i];
+		if (d->deadband[i] < 0 || delta > d->deadband[i] || -delta > d->deadband[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+owacq_publish(owacq_t *a, owacq_dev_t *d)
+{
+	if (!owacq_significant(d)) {
+		d->suppressed++;
+		a->suppressed++;
+		return;
+	}
+	d->published = d->reading;
+	d->has_published = 1;
+	d->emitted++;
+	a->emitted++;
+	if (a->publish) {
+		a->publish(a, d, a->arg);
+	}
+}
+
+/* Score the read and move the device between the lanes */
+static void
+owacq_health(owacq_t *a, owacq_dev_t *d, uint64_t elapsed)
+{
+	double score = 1;
+
+	/* Not the fault of the device */
+	if (d->reading.error == OWACQ_ERR_CANCEL) {
+		return;
+	}
+	d->reads++;
+	if (d->reading.error == OWACQ_ERR_CRC) {
+		d->crc_errors++;
+		score = 0;
+	} else if (d->reading.status != 0) {
+		d->errors++;
+		score = 0;
+	} else if (d->reading.retries ||
+		   elapsed > OWACQ_SLOW_READ_FACTOR * owacq_model_cost(a, d)) {
+		d->slow_reads++;
+		score = 0.5;
+	}
+	d->health += (score - d->health) / 8;
+
+	if (!d->slow && d->health < OWACQ_HEALTH_QUARANTINE) {
+		d->slow = 1;
+		d->quarantines++;
+		a->nslow++;
+		owlog(OWLOG_INFO, "device %016llx moved to the slow lane, %lu errors",
+		      rom_key(d->addr), d->errors + d->crc_errors);
+	} else if (d->slow && d->health > OWACQ_HEALTH_PROMOTE) {
+		d->slow = 0;
+		a->nslow--;
+		owlog(OWLOG_INFO, "device %016llx back from the slow lane", rom_key(d->addr));
+	}
+}
+
+/* Account for a read and pass the reading on */
+static int
+owacq_finish(owacq_t *a, owacq_dev_t *d, uint64_t elapsed)
+{
+	/* Read again next cycle */
+	if (d->reading.error == OWACQ_ERR_CANCEL) {
+		return 0;
+	}
+	/* Failed reads of a quarantined device do not distort its cost */
+	if (d->reading.status == 0) {
+		d->cost = d->cost ? (d->cost * 7 + elapsed) / 8 : elapsed;
+	}
+	owacq_adapt(a, d);
+	owacq_health(a, d, elapsed);
+	d->next_due = d->reading.read.mono + owacq_interval(a, d);
+	owacq_aggregate(a, d);
+	owacq_publish(a, d);
+	return d->reading.status == 0;
+}
+
+/*
+ * Read a device, retrying transient failures within the budget of
+ * its lane. The cost and the latency scored are those of the last
+ * attempt; the time of the retries is accounted as retry cost.
+ *
+ * @param tries Retries already made, 1 when retrying a failed batch
+ */
+static int
+owacq_read(owacq_t *a, owacq_dev_t *d, int *used, int budget, int tries)
+{
+	owacq_reading_t *r = &d->reading;
+	uint64_t start;
+
+	for (;;) {
+		start = monotonic_ns();
+		if (d->type == OWACQ_THERMOMETER) {
+			owacq_read_thermometer(a, d);
+		} else {
+			owacq_read_counter(a, d);
+		}
+		start = monotonic_ns() - start;
+		r->retries = tries;
+		r->error = OWACQ_ERR_NONE;
+		if (tries) {
+			a->cycle_retry_time += start;
+			a->retry_time += start;
+		}
+		if (r->status == 0) {
+			break;
+		}
+		r->error = owacq_classify(a, r->status);
+		if (!owacq_retry(a, r->error, used, budget, tries)) {
+			break;
+		}
+		tries++;
+		d->retries++;
+	}
+	return owacq_finish(a, d, start);
+}
+
+struct owacq_batch {
+	owacq_t *a;
+	int idx[OWACQ_MAX_DEVS];
+	uint64_t last;         /* When the previous result arrived */
+	int ok;
+};
+
+/*
+ * Called as soon as the scratchpad of a batched thermometer has
+ * arrived. Good readings are passed on right away; failed ones are
+ * left for owacq_read_batch() to retry.
+ */
+static void
+owacq_batch_ready(int i, int status, uint8_t *sp, void *arg)
+{
+	struct owacq_batch *b = arg;
+	owacq_dev_t *d = &b->a->devs[b->idx[i]];
+	owacq_reading_t *r = &d->reading;
+	uint64_t elapsed;
+
+	owtime_now(&r->read);
+	elapsed = r->read.mono - b->last;
+	b->last = r->read.mono;
+	owacq_thermometer_value(b->a, d, status, sp);
+	r->retries = 0;
+	r->error = OWACQ_ERR_NONE;
+	if (status == 0) {
+		b->ok += owacq_finish(b->a, d, elapsed);
+	}
+}
+
+/*
+ * Read all due thermometers of the fast lane in batches, so the
+ * result of each is delivered as soon as it is on the host rather
+ * than when the whole batch is done. The bus time of a device is the
+ * time since the previous result.
+ *
+ * @param batched Set to 1 for every device read
+ *
+ * Returns: number of devices read successfully
+ */
+static int
+owacq_read_batch(owacq_t *a, uint64_t now, uint8_t *batched)
+{
+	uint8_t roms[OWACQ_MAX_DEVS][8];
+	struct owacq_batch b;
+	owacq_dev_t *d;
+	int n = 0;
+	int i;
+
+	b.a = a;
+	b.ok = 0;
+	for (i = 0; i < a->ndevs; i++) {
+		d = &a->devs[i];
+		if (d->type == OWACQ_THERMOMETER && !d->slow && owacq_due(a, d, now)) {
+			memcpy(roms[n], d->addr, 8);
+			b.idx[n++] = i;
+			batched[i] = 1;
+		}
+	}
+	if (n == 0) {
+		return 0;
+	}
+	b.last = monotonic_ns();
+	ds18b20_read_batch(a->dev, roms, n, owacq_batch_ready, &b);
+
+	/* The adapter status tells nothing about a single batched device */
+	for (i = 0; i < n; i++) {
+		d = &a->devs[b.idx[i]];
+		if (d->reading.status == 0) {
+			continue;
+		}
+		switch (d->reading.status) {
+		case OWUSB_ECRC: d->reading.error = OWACQ_ERR_CRC; break;
+		case OWUSB_ECANCEL: d->reading.error = OWACQ_ERR_CANCEL; break;
+		default: d->reading.error = OWACQ_ERR_IO; break;
+		}
+		if (owacq_retry(a, d->reading.error, &a->cycle_retries, a->retry_budget, 0)) {
+			d->retries++;
+			b.ok += owacq_read(a, d, &a->cycle_retries, a->retry_budget, 1);
+		} else {
+			owacq_finish(a, d, owacq_model_cost(a, d));
+		}
+	}
+	return b.ok;
+}
+
+/*
+ * Read all devices that are due, first the healthy ones and then at
+ * most slow_budget devices of the slow lane. The result of each
+ * device is left in its reading, and significant ones are published.
+ *
+ * Returns: number of devices read successfully
+ */
+
+int
+owacq_collect(owacq_t *a)
+{
+	owacq_dev_t *d;
+	uint64_t now = monotonic_ns();
+	uint8_t batched[OWACQ_MAX_DEVS];
+	unsigned gen = a->dev->cancel_gen;
+	int budget = a->slow_budget;
+	int slow_retries = 0;
+	int lane;
+	int i;
+	int ok = 0;
+
+	memset(batched, 0, sizeof(batched));
+	if (a->batch && a->converting) {
+		ok += owacq_read_batch(a, now, batched);
+	}
+	for (lane = 0; lane < 2; lane++) {
+		for (i = 0; i < a->ndevs; i++) {
+			d = &a->devs[i];
+			if (a->dev->cancel_gen != gen) {
+				return ok;
+			}
+			if (d->slow != lane || batched[i] || !owacq_due(a, d, now)) {
+				continue;
+			}
+			if (d->type == OWACQ_THERMOMETER && !a->converting) {
+				continue;
+			}
+			if (lane == 1 && budget-- <= 0) {
+				break;
+			}
+			if (lane == 0) {
+				ok += owacq_read(a, d, &a->cycle_retries, a->retry_budget, 0);
+			} else {
+				ok += owacq_read(a, d, &slow_retries, a->slow_retry_budget, 0);
+			}
+		}
+	}
+	return ok;
+}
+
+/*
+ * Run a complete cycle: convert, wait and collect.
+ *
+ * Returns: number of devices read successfully, < 0 on failure
+ */
+
+int
+owacq_cycle(owacq_t *a)
+{
+	int r;
+
+	if ((r = owacq_convert(a)) != 0) {
+		return r;
+	}
+	if ((r = owacq_wait_convert(a)) != 0) {
+		return r;
+	}
+	return owacq_collect(a);
+}
@@ -0,0 +1,218 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef ACQUIRE_H
+#define ACQUIRE_H
+
+#include <stdint.h>
+#include "ds2490.h"
+#include "ds2423.h"
+
+#ifndef OWACQ_MAX_DEVS
+#define OWACQ_MAX_DEVS 64
+#endif
+#define OWACQ_MAX_VALUES 4
+
+/* Maximum time to wait for a temperature conversion */
+#define OWACQ_CONVERT_TIMEOUT_MS 1000
+
+/* Conversion time at 12 bits resolution */
+#define OWACQ_CONVERT_MS 750
+
+/* Largest factor the planner slows a device down by */
+#define OWACQ_MAX_SLOWDOWN 64
+
+/* Health scores moving a device to the slow lane and back */
+#define OWACQ_HEALTH_QUARANTINE 0.5
+#define OWACQ_HEALTH_PROMOTE 0.9
+
+/* A read taking this many times its modelled cost counts as slow */
+#define OWACQ_SLOW_READ_FACTOR 4
+
+/* Default interval and reads per cycle of the slow lane */
+#define OWACQ_SLOW_INTERVAL_MS 60000
+#define OWACQ_SLOW_BUDGET 1
+
+/* Retries of one read, and default retries per cycle in each lane */
+#define OWACQ_MAX_RETRIES 2
+#define OWACQ_RETRY_BUDGET 4
+#define OWACQ_SLOW_RETRY_BUDGET 1
+
+/*
+ * Classes of failures, from the result codes of the adapter. Only
+ * failures that are likely to be transient are retried: CRC errors,
+ * alarming presence pulses and USB errors. A short circuit or a
+ * missing device will fail again in the same cycle.
+ */
+enum {
+	OWACQ_ERR_NONE = 0,
+	OWACQ_ERR_IO,          /* USB transfer failed or short read */
+	OWACQ_ERR_CRC,         /* RESULT_CRC or CRC check of the data */
+	OWACQ_ERR_APP,         /* RESULT_APP, alarming presence pulse */
+	OWACQ_ERR_NRS,         /* RESULT_NRS, no presence pulse */
+	OWACQ_ERR_SH,          /* RESULT_SH, bus short circuit */
+	OWACQ_ERR_CANCEL,      /* Cancelled with owusb_cancel() */
+	OWACQ_ERR_CLASSES
+};
+
+enum {
+	OWACQ_THERMOMETER = 1, /* DS18B20, DS1822, DS28EA00 */
+	OWACQ_COUNTER = 2      /* DS2423 */
+};
+
+/* A point in time on both the monotonic and the wall clock, in ns */
+typedef struct owtime {
+	uint64_t mono;
+	uint64_t wall;
+} owtime_t;
+
+/*
+ * Result of reading one device. Thermometers have the temperature in
+ * value[0]. Counters have the counts of A and B in value[0] and
+ * value[1] and their rates in value[2] and value[3].
+ *
+ * The convert time is when the temperature conversion started, which
+ * is what the value represents; in a large batch the data may be read
+ * much later. For counters both times are the time of the read.
+ */
+typedef struct owacq_reading {
+	int status;            /* 0 or one of OWUSB_E* */
+	int error;             /* OWACQ_ERR_* of a failed status */
+	int retries;           /* Retries it took */
+	int nvalues;
+	double value[OWACQ_MAX_VALUES];
+	owtime_t convert;
+	owtime_t read;
+} owacq_reading_t;
+
+/*
+ * Aggregate of the successful readings of a device within a window.
+ * Windows are aligned with the wall clock, e.g. 60 s windows start on
+ * whole minutes, and readings are assigned by their convert time.
+ */
+typedef struct owacq_agg {
+	uint64_t start;        /* Wall clock ns of the window start */
+	unsigned long count;
+	int nvalues;
+	double min[OWACQ_MAX_VALUES];
+	double max[OWACQ_MAX_VALUES];
+	double sum[OWACQ_MAX_VALUES];
+	double last[OWACQ_MAX_VALUES];
+} owacq_agg_t;
+
+/*
+ * A reading is published when a value has moved more than its
+ * deadband away from the last published value, when the status
+ * changes, or when nothing has been published for max_silence ns.
+ * As the deadband is relative to the last published value, noise
+ * around a level does not cause repeated publishing. A negative
+ * deadband publishes every reading.
+ */
+typedef struct owacq_dev {
+	uint8_t addr[8];
+	int type;              /* OWACQ_THERMOMETER or OWACQ_COUNTER */
+	ds2423_t counter;
+	owacq_reading_t reading; /* Last reading */
+	double deadband[OWACQ_MAX_VALUES];
+	uint64_t max_silence;  /* ns, 0 for no heartbeat */
+	owacq_reading_t published; /* Last published reading */
+	int has_published;
+	unsigned long emitted;
+	unsigned long suppressed;
+	/*
+	 * Adaptive polling. With max_interval set, the device is only
+	 * read when due. The interval is halved when the signal changed
+	 * more than threshold since the previous read, and grows by a
+	 * quarter when it changed less than a quarter of threshold.
+	 */
+	uint64_t interval;     /* ns, current interval */
+	uint64_t min_interval;
+	uint64_t max_interval; /* 0 to read the device every cycle */
+	double threshold;
+	uint64_t next_due;     /* Monotonic ns */
+	uint64_t cost;         /* Bus time of a read in ns, smoothed */
+	double last_value;
+	int has_last;
+	owacq_agg_t window;    /* Window being aggregated */
+	owacq_agg_t completed; /* Last completed window */
+	int priority;          /* Higher is more important, default 0 */
+	int slowdown;          /* Interval factor set by the planner */
+	/*
+	 * Health. Each read scores 1 when good, 0.5 when good but slow
+	 * and 0 when failed, and the health is a moving average of the
+	 * scores. A device falling below OWACQ_HEALTH_QUARANTINE is moved
+	 * to the slow lane, where it is read after all healthy devices,
+	 * at the slow interval and within the slow lane budget, until it
+	 * is back above OWACQ_HEALTH_PROMOTE.
+	 */
+	double health;
+	int slow;              /* In the slow lane */
+	unsigned long reads;
+	unsigned long crc_errors;
+	unsigned long errors;  /* Other failures */
+	unsigned long slow_reads; /* Good but slow reads */
+	unsigned long quarantines;
+	unsigned long retries;
+} owacq_dev_t;
+
+/* Acquisition state of one adapter */
+typedef struct owacq {
+	owusb_device_t *dev;
+	int ndevs;
+	owacq_dev_t devs[OWACQ_MAX_DEVS];
+	owtime_t convert;      /* Start of the last conversion */
+	/* Called for each published reading */
+	void (*publish)(struct owacq *a, owacq_dev_t *d, void *arg);
+	void *arg;
+	unsigned long emitted;
+	unsigned long suppressed;
+	uint64_t period;       /* Cycle period in ns, if cycles are periodic */
+	double budget;         /* Max fraction of bus time, 0 for no limit */
+	int converting;        /* A conversion was started this cycle */
+	uint64_t window;       /* Aggregation window in ns, 0 for none */
+	int speed;             /* PARAM_SPEED_*, used by the planner */
+	uint64_t convert_time; /* ns, conversion time of the thermometers */
+	uint64_t slow_interval; /* ns, shortest interval of the slow lane */
+	int slow_budget;       /* Slow lane reads per cycle */
+	int nslow;             /* Devices in the slow lane */
+	int retry_budget;      /* Retries per cycle of healthy devices */
+	int slow_retry_budget; /* Retries per cycle in the slow lane */
+	int cycle_retries;     /* Retries in the current cycle */
+	uint64_t cycle_retry_time; /* ns spent on them */
+	unsigned long retries;
+	uint64_t retry_time;   /* ns spent on retries in total */
+	unsigned long errors[OWACQ_ERR_CLASSES]; /* Failed attempts per class */
+	int batch;             /* Read the thermometers in batches */
+} owacq_t;
+
+/*
+ * Bus time needed per cycle period. The bus is held for the whole
+ * conversion, as the adapter polls for its completion.
+ */
+typedef struct owacq_capacity {
+	uint64_t period;
+	uint64_t convert;      /* ns per period spent converting */
+	uint64_t reads;        /* ns per period spent reading devices */
+	double utilisation;    /* (convert + reads) / period */
+	double headroom;       /* Budget, or 1, less utilisation */
+	int degraded;          /* Devices slowed down to fit */
+} owacq_capacity_t;
+
+void owtime_now(owtime_t *t);
+
+void owacq_init(owacq_t *a, owusb_device_t *dev);
+int  owacq_add(owacq_t *a, const uint8_t *addr);
+int  owacq_discover(owacq_t *a);
+void owacq_set_deadband(owacq_t *a, int i, double deadband, uint64_t max_silence);
+void owacq_set_adaptive(owacq_t *a, int i, uint64_t min_interval, uint64_t max_interval, double threshold);
+double owacq_load(owacq_t *a);
+int  owacq_aggregates(owacq_t *a, owacq_agg_t *out, int n, int completed);
+uint64_t owacq_cost(owacq_t *a, int i);
+uint64_t owacq_read_interval(owacq_t *a, int i);
+void owacq_capacity(owacq_t *a, owacq_capacity_t *c);
+int  owacq_plan(owacq_t *a, owacq_capacity_t *c);
+int  owacq_convert(owacq_t *a);
+int  owacq_wait_convert(owacq_t *a);
+int  owacq_collect(owacq_t *a);
+int  owacq_cycle(owacq_t *a);
+
+#endif
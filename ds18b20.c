@@ -0,0 +1,239 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#include <string.h>
+#include <unistd.h>
+#include "ds18b20.h"
+#include "util.h"
+
+#define DS18B20_CMD_WRITE_SCRATCHPAD 0x4e
+#define DS18B20_CMD_READ_SCRATCHPAD 0xbe
+#define DS18B20_CMD_COPY_SCRATCHPAD 0x48
+#define DS18B20_CMD_RECALL_E2 0xb8
+
+/* Maximum EEPROM write time of the copy scratchpad command */
+#define DS18B20_COPY_MS 10
+
+
+/*
+ * Put the ROM command selecting addr, or Skip ROM if addr is NULL,
+ * in buf followed by cmd.
+ *
+ * Returns: number of bytes used
+ */
+
+static int
+ds18b20_select(uint8_t *buf, const uint8_t *addr, uint8_t cmd)
+{
+	if (addr == NULL) {
+		buf[0] = WIRE_CMD_SKIP_ROM;
+		buf[1] = cmd;
+		return 2;
+	}
+	buf[0] = WIRE_CMD_MATCH_ROM;
+	memcpy(&buf[1], addr, 8);
+	buf[9] = cmd;
+	return 10;
+}
+
+/*
+ * Temperature in degrees Celsius from a scratchpad. The bits that are
+ * undefined at the configured resolution are masked off.
+ */
+
+double
+ds18b20_temp(const uint8_t *sp)
+{
+	int16_t raw = sp[0] | sp[1] << 8;
+	int res = sp[4] >> 5 & 0x3;
+
+	raw &= ~((1 << (3 - res)) - 1);
+	return raw / 16.0;
+}
+
+/*
+ * Read and CRC check the scratchpad of a single device.
+ *
+ * @param sp Buffer of DS18B20_SCRATCHPAD_LEN bytes
+ *
+ * Returns: 0 on success, < 0 on failure
+ */
+
+int
+ds18b20_read_scratchpad(owusb_device_t *dev, const uint8_t *addr, uint8_t *sp)
+{
+	uint8_t buf[10];
+	int len;
+	int r;
+
+	len = ds18b20_select(buf, addr, DS18B20_CMD_READ_SCRATCHPAD);
+	if ((r = owusb_read_straight(dev, buf, len, sp, DS18B20_SCRATCHPAD_LEN, 1)) != 0) {
+		return r;
+	}
+	if (calc_crc8(sp, DS18B20_SCRATCHPAD_LEN) != 0) {
+		return OWUSB_ECRC;
+	}
+	return 0;
+}
+
+struct ds18b20_batch {
+	int base;
+	int done;              /* Devices of the batch passed to ready */
+	int ok;
+	void (*ready)(int i, int status, uint8_t *sp, void *arg);
+	void *arg;
+};
+
+static void
+ds18b20_batch_ready(int i, uint8_t *data, void *arg)
+{
+	struct ds18b20_batch *b = arg;
+	int status = 0;
+
+	if (calc_crc8(data, DS18B20_SCRATCHPAD_LEN) != 0) {
+		status = OWUSB_ECRC;
+	} else {
+		b->ok++;
+	}
+	b->done = i + 1;
+	b->ready(b->base + i, status, data, b->arg);
+}
+
+/*
+ * Read the scratchpads of many devices, DS18B20_BATCH at a time, with
+ * each result passed to ready as soon as it has arrived. Every device
+ * is passed to ready once, in order, with a status of 0 or < 0 if it
+ * failed, OWUSB_ECANCEL for those not read because of owusb_cancel().
+ *
+ * Returns: number of scratchpads read successfully
+ */
+
+int
+ds18b20_read_batch(owusb_device_t *dev, uint8_t (*roms)[8], int n,
+		   void (*ready)(int i, int status, uint8_t *sp, void *arg), void *arg)
+{
+	uint8_t cmd[DS18B20_BATCH * 10];
+	uint8_t sp[DS18B20_BATCH * DS18B20_SCRATCHPAD_LEN];
+	struct ds18b20_batch b;
+	unsigned gen = dev->cancel_gen;
+	int count;
+	int i;
+
+	b.ok = 0;
+	b.ready = ready;
+	b.arg = arg;
+	for (b.base = 0; b.base < n; b.base += count) {
+		count = n - b.base < DS18B20_BATCH ? n - b.base : DS18B20_BATCH;
+		for (i = 0; i < count; i++) {
+			ds18b20_select(&cmd[i * 10], roms[b.base + i], DS18B20_CMD_READ_SCRATCHPAD);
+		}
+		b.done = 0;
+		owusb_read_straight_batch(dev, cmd, 10, sp, DS18B20_SCRATCHPAD_LEN,
+					  count, ds18b20_batch_ready, &b);
+		/* A failed batch may already have passed some devices on */
+		for (i = b.done; i < count; i++) {
+			ready(b.base + i, dev->cancel_gen != gen ? OWUSB_ECANCEL : OWUSB_EIO, NULL, arg);
+		}
+		if (dev->cancel_gen != gen) {
+			for (i = b.base + count; i < n; i++) {
+				ready(i, OWUSB_ECANCEL, NULL, arg);
+			}
+			break;
+		}
+	}
+	return b.ok;
+}
+
+/*
+ * Write the alarm thresholds and resolution.
+ *
+ * @param res DS18B20_RES_9BIT to DS18B20_RES_12BIT
+ */
+
+int
+ds18b20_write_scratchpad(owusb_device_t *dev, const uint8_t *addr, int8_t th, int8_t tl, int res)
+{
+	uint8_t buf[13];
+	int len;
+
+	len = ds18b20_select(buf, addr, DS18B20_CMD_WRITE_SCRATCHPAD);
+	buf[len++] = th;
+	buf[len++] = tl;
+	buf[len++] = (res & 0x3) << 5 | 0x1f;
+	return owusb_block_io(dev, buf, len, NULL, 0, 1, 0);
+}
+
+/*
+ * Copy the scratchpad to EEPROM. The strong pullup supplies parasite
+ * powered devices during the EEPROM write; when broadcast, a single
+ * pullup covers the whole bus.
+ */
+
+int
+ds18b20_copy_scratchpad(owusb_device_t *dev, const uint8_t *addr)
+{
+	uint8_t buf[10];
+	int len;
+	int r;
+
+	if ((r = owusb_strong_pullup(dev, DS18B20_COPY_MS)) < 0) {
+		return r;
+	}
+	len = ds18b20_select(buf, addr, DS18B20_CMD_COPY_SCRATCHPAD);
+	r = owusb_block_io(dev, buf, len, NULL, 0, 1, 1);
+	/* The pullup runs in 16ms steps after the block has completed */
+	usleep((DS18B20_COPY_MS + 15) / 16 * 16 * 1000);
+	return r;
+}
+
+int
+ds18b20_recall_e2(owusb_device_t *dev, const uint8_t *addr)
+{
+	uint8_t buf[10];
+	int len;
+
+	len = ds18b20_select(buf, addr, DS18B20_CMD_RECALL_E2);
+	return owusb_block_io(dev, buf, len, NULL, 0, 1, 0);
+}
+
+static int
+ds18b20_matches(const uint8_t *sp, int8_t th, int8_t tl, int res)
+{
+	return (int8_t)sp[2] == th && (int8_t)sp[3] == tl &&
+		(sp[4] >> 5 & 0x3) == (res & 0x3);
+}
+
+/*
+ * Verify the configuration of a set of devices, typically after a
+ * broadcast write. Devices that do not match, or could not be read,
+ * are rewritten individually and only those are read back again.
+ *
+ * @param failed Optional array of n entries, set to 1 for devices
+ * that still do not match
+ *
+ * Returns: number of devices that still do not match
+ */
+
+int
+ds18b20_verify(owusb_device_t *dev, uint8_t (*roms)[8], int n,
+	       int8_t th, int8_t tl, int res, int *failed)
+{
+	uint8_t sp[DS18B20_SCRATCHPAD_LEN];
+	int i;
+	int bad = 0;
+
+	for (i = 0; i < n; i++) {
+		if (failed) failed[i] = 0;
+		if (ds18b20_read_scratchpad(dev, roms[i], sp) == 0 &&
+		    ds18b20_matches(sp, th, tl, res)) {
+			continue;
+		}
+		ds18b20_write_scratchpad(dev, roms[i], th, tl, res);
+		if (ds18b20_read_scratchpad(dev, roms[i], sp) == 0 &&
+		    ds18b20_matches(sp, th, tl, res)) {
+			continue;
+		}
+		if (failed) failed[i] = 1;
+		bad++;
+	}
+	return bad;
+}
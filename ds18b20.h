@@ -0,0 +1,36 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef DS18B20_H
+#define DS18B20_H
+
+#include <stdint.h>
+#include "ds2490.h"
+
+#define DS18B20_FAMILY 0x28
+#define DS18B20_SCRATCHPAD_LEN 9
+
+/* Scratchpad reads per batch, limited by the adapter FIFO */
+#define DS18B20_BATCH (DS2490_FIFOSIZE / 10)
+
+/* Resolution setting, also the value of bits 5-6 of the config byte */
+enum {
+	DS18B20_RES_9BIT = 0,
+	DS18B20_RES_10BIT = 1,
+	DS18B20_RES_11BIT = 2,
+	DS18B20_RES_12BIT = 3
+};
+
+/*
+ * Functions taking an address use Match ROM; a NULL address
+ * broadcasts the command to all devices on the bus using Skip ROM.
+ */
+double ds18b20_temp(const uint8_t *sp);
+int ds18b20_read_scratchpad(owusb_device_t *dev, const uint8_t *addr, uint8_t *sp);
+int ds18b20_read_batch(owusb_device_t *dev, uint8_t (*roms)[8], int n,
+		       void (*ready)(int i, int status, uint8_t *sp, void *arg), void *arg);
+int ds18b20_write_scratchpad(owusb_device_t *dev, const uint8_t *addr, int8_t th, int8_t tl, int res);
+int ds18b20_copy_scratchpad(owusb_device_t *dev, const uint8_t *addr);
+int ds18b20_recall_e2(owusb_device_t *dev, const uint8_t *addr);
+int ds18b20_verify(owusb_device_t *dev, uint8_t (*roms)[8], int n, int8_t th, int8_t tl, int res, int *failed);
+
+#endif
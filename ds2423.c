@@ -0,0 +1,115 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#include <string.h>
+#include "ds2423.h"
+#include "util.h"
+
+#define DS2423_READ_MEMORY_COUNTER 0xa5
+#define DS2423_PAGE_SIZE 32
+#define DS2423_COUNTER_PAGE 14
+
+/* Match ROM, 8 byte ROM, command and two address bytes */
+#define DS2423_CMD_LEN 12
+/* Last data byte of the page, counter, four zero bytes and CRC16 */
+#define DS2423_READ_LEN 11
+
+
+void
+ds2423_init(ds2423_t *c, const uint8_t *addr, int channels)
+{
+	memset(c, 0, sizeof(*c));
+	memcpy(c->addr, addr, 8);
+	c->channels = channels;
+}
+
+/*
+ * Read one of the two external counters of a DS2423.
+ *
+ * Instead of reading the whole 32 byte page the read starts at the
+ * last byte of the counter page, so only the counter, the zero
+ * padding and the CRC16 follow. The time stamp is taken at the middle
+ * of the transfer.
+ *
+ * @param counter DS2423_COUNTER_A or DS2423_COUNTER_B
+ * @param count Counter value
+ * @param time Monotonic time of the read in ns
+ *
+ * Returns: 0 on success, < 0 on failure
+ */
+
+int
+ds2423_read_counter(owusb_device_t *dev, const uint8_t *addr, int counter,
+		    uint32_t *count, uint64_t *time)
+{
+	uint8_t buf[DS2423_CMD_LEN + DS2423_READ_LEN];
+	uint8_t *in = &buf[DS2423_CMD_LEN];
+	int address;
+	uint64_t start;
+	int r;
+
+	address = (DS2423_COUNTER_PAGE + counter + 1) * DS2423_PAGE_SIZE - 1;
+	buf[0] = WIRE_CMD_MATCH_ROM;
+	memcpy(&buf[1], addr, 8);
+	buf[9] = DS2423_READ_MEMORY_COUNTER;
+	buf[10] = address & 0xff;
+	buf[11] = address >> 8;
+
+	start = monotonic_ns();
+	if ((r = owusb_read_straight(dev, buf, DS2423_CMD_LEN, in, DS2423_READ_LEN, 1)) != 0) {
+		return r;
+	}
+	*time = start + (monotonic_ns() - start) / 2;
+
+	/* The CRC covers the command, address and all data read */
+	if (calc_crc16(&buf[9], sizeof(buf) - 9) != 0xb001) {
+		return OWUSB_ECRC;
+	}
+	*count = in[1] | in[2] << 8 | in[3] << 16 | (uint32_t)in[4] << 24;
+	return 0;
+}
+
+/*
+ * Read the enabled counters of a DS2423 and update the rates. The
+ * counters are 32 bits and wrap around, which the unsigned
+ * subtraction takes care of.
+ *
+ * Nothing is updated unless all enabled counters were read, so a
+ * retry after a failure on one counter does not shorten the interval
+ * the rate of another is computed over.
+ *
+ * Returns: number of counters read, < 0 if a read failed
+ */
+
+int
+ds2423_sample(owusb_device_t *dev, ds2423_t *c)
+{
+	uint32_t count[DS2423_COUNTERS];
+	uint64_t time[DS2423_COUNTERS];
+	int i, r;
+	int n = 0;
+
+	for (i = 0; i < DS2423_COUNTERS; i++) {
+		if (!(c->channels & (1 << i))) {
+			continue;
+		}
+		if ((r = ds2423_read_counter(dev, c->addr, i, &count[i], &time[i])) != 0) {
+			c->errors++;
+			return r;
+		}
+	}
+	for (i = 0; i < DS2423_COUNTERS; i++) {
+		if (!(c->channels & (1 << i))) {
+			continue;
+		}
+		if (c->valid[i] && time[i] > c->time[i]) {
+			c->rate[i] = (uint32_t)(count[i] - c->count[i]) * 1e9 / (time[i] - c->time[i]);
+			c->valid[i] = 2;
+		} else {
+			c->valid[i] = 1;
+		}
+		c->count[i] = count[i];
+		c->time[i] = time[i];
+		n++;
+	}
+	return n;
+}
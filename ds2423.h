@@ -0,0 +1,35 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef DS2423_H
+#define DS2423_H
+
+#include <stdint.h>
+#include "ds2490.h"
+
+#define DS2423_FAMILY 0x1d
+
+/* The two external counter inputs are tied to memory pages 14 and 15 */
+enum {
+	DS2423_COUNTER_A = 0,
+	DS2423_COUNTER_B = 1,
+	DS2423_COUNTERS = 2
+};
+
+#define DS2423_CHANNEL_A (1 << DS2423_COUNTER_A)
+#define DS2423_CHANNEL_B (1 << DS2423_COUNTER_B)
+
+typedef struct ds2423 {
+	uint8_t addr[8];
+	int channels;                  /* DS2423_CHANNEL_* mask to sample */
+	uint32_t count[DS2423_COUNTERS];
+	uint64_t time[DS2423_COUNTERS]; /* Monotonic ns of the last read */
+	double rate[DS2423_COUNTERS];  /* Counts per second */
+	int valid[DS2423_COUNTERS];    /* 1: count read, 2: rate valid */
+	int errors;
+} ds2423_t;
+
+void ds2423_init(ds2423_t *c, const uint8_t *addr, int channels);
+int  ds2423_read_counter(owusb_device_t *dev, const uint8_t *addr, int counter, uint32_t *count, uint64_t *time);
+int  ds2423_sample(owusb_device_t *dev, ds2423_t *c);
+
+#endif
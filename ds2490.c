@@ -1,17 +1,27 @@
 /* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
 
 #include <usb.h>
+#include <pthread.h>
+#ifndef OWUSB_NO_STDIO
 #include <stdio.h>
+#endif
 #include <unistd.h>
 #include <string.h>
 #include "ds2490.h"
+#include "log.h"
+#include "probes.h"
+#include "util.h"
 
 #define VENDOR_MAXIM 0x04FA
 #define PRODUCT_2490 0x2490
-#define MAX_USBDEVS 4
+/* Fixed limits, can be lowered for small targets */
+#ifndef MAX_USBDEVS
+#define MAX_USBDEVS 16
+#endif
+#ifndef MAX_OWDEVS
 #define MAX_OWDEVS 128
+#endif
 #define USB_TIMEOUT 5000
-#define DS2490_FIFOSIZE 128
 
 #define USB_ALT_INTERFACE 1
 #define EP3 3
@@ -103,13 +113,14 @@ owusb_device_t owusb_devs[MAX_USBDEVS];
 int owusb_dev_count = 0;
 
 
-const char *ow_speed[] = { 
+#ifndef OWUSB_NO_STDIO
+static const char *const ow_speed[] = { 
 	"Regular", 
 	"Flexible", 
 	"Overdrive" 
 };
 
-const char *ow_slew_rate[] = {
+static const char *const ow_slew_rate[] = {
 	"15V/us", 
 	"2.20V/us",
 	"1.65Vus",
@@ -119,6 +130,7 @@ const char *ow_slew_rate[] = {
 	"0.70V/us",
 	"0.55V/us"
 };
+#endif
 
 /**************************************************************
  * Control commands
@@ -650,32 +662,58 @@ owusb_com_search_access(owusb_device_t *d, int params, int discrepancy, int noac
 	return usb_control_msg(d->handle, USB_DEVICE_TO_HOST, COMM_CMD, COM_SEARCH_ACCESS | params, index, NULL, 0, USB_TIMEOUT);
 }
 
+/*
+ * Check from the status packet whether an adapter is in the mode it
+ * is used in: regular speed, running, idle and with all FIFOs empty.
+ * The strong pullup settings are not checked, since they are set for
+ * every use.
+ */
+
+static int
+owusb_mode_ok(owusb_device_t *d)
+{
+	uint8_t *s = d->interrupt_data;
+
+	owusb_interrupt_read(d);
+	if (d->interrupt_len <= STATE_DATA_IN_BUFFER_STATUS) {
+		return 0;
+	}
+	return s[STATE_1WIRE_SPEED] == PARAM_SPEED_REGULAR &&
+		(s[STATE_STATUS_FLAGS] & (STATE_IDLE | STATE_HALT)) == STATE_IDLE &&
+		s[STATE_COMBUFFER_STATUS] == 0 &&
+		s[STATE_DATA_OUT_BUFFER_STATUS] == 0 &&
+		s[STATE_DATA_IN_BUFFER_STATUS] == 0;
+}
+
 /*
  * Initialize DS2490 device
  * 
  * @param i DS2490 count
  * @param dev USB device
+ * @param warm Skip the reset if the adapter is already in the right mode
  * 
  * Returns: 0 on success, < 0 on failure
  */
 
 static int
-owusb_init_dev(int i, struct usb_device *dev)
+owusb_init_dev(int i, struct usb_device *dev, int warm)
 {
 	struct usb_dev_handle *h;
 	
 	h = usb_open(dev);
-	if (h <= 0) {
+	if (h == NULL) {
 		return -1;
 	}
 	
 	/* Configuration 0: not configured; 1: configured */
 	if (usb_set_configuration(h, 1) < 0) {
+		usb_close(h);
 		return -2;
 	}
 
 	/* Interface 0 is the only valid interface value for the DS2490 */
 	if (usb_claim_interface(h, 0) < 0) {
+		usb_close(h);
 		return -3;
 	}
 
@@ -687,6 +725,8 @@ owusb_init_dev(int i, struct usb_device *dev)
 	 * 3: 1ms       64 bytes
 	 */
 	if (usb_set_altinterface(h, USB_ALT_INTERFACE) < 0) {
+		usb_release_interface(h, 0);
+		usb_close(h);
 		return -4;
 	}
 
@@ -696,7 +736,12 @@ owusb_init_dev(int i, struct usb_device *dev)
 	owusb_devs[i].interrupt_len = 0;
 	owusb_devs[i].setting = USB_ALT_INTERFACE;
 
-	owusb_ctl_reset(&owusb_devs[i]);
+	owusb_devs[i].warm = warm && owusb_mode_ok(&owusb_devs[i]);
+	if (!owusb_devs[i].warm) {
+		owusb_ctl_reset(&owusb_devs[i]);
+	}
+	owlog(OWLOG_INFO, "adapter %ld: attached %s", i,
+	      owusb_devs[i].warm ? "warm" : "with reset");
 	return 0;
 }
 
@@ -706,81 +751,247 @@ owusb_init_dev(int i, struct usb_device *dev)
  */
 
 
+static int owusb_enumerated;
+
 /*
- * Initalize the owusb library. This function must be called before any
- * other function.
+ * Find the adapters on the USB busses without opening them. This is
+ * only done once; later calls return the same count.
  *
- * Returns: 0 on success, < 0 on failure
+ * Returns: number of adapters found
  */
 
 int
-owusb_init(void)
+owusb_enumerate(void)
 {
-	int b, d, e;
 	struct usb_bus *bus;
 	struct usb_device *dev;
 
+	if (owusb_enumerated) {
+		return owusb_dev_count;
+	}
 	usb_init();
-	b = usb_find_busses();
-	d = usb_find_devices();
+	usb_find_busses();
+	usb_find_devices();
 
 	owusb_dev_count = 0;
 	for (bus = usb_busses; bus; bus = bus->next) {
 		for (dev = bus->devices; dev; dev = dev->next) {
 			if (dev->descriptor.idVendor == VENDOR_MAXIM &&
-			    dev->descriptor.idProduct == PRODUCT_2490) {
-				if ((e = owusb_init_dev(owusb_dev_count++, dev)) != 0) {
-					return e;
-				}
+			    dev->descriptor.idProduct == PRODUCT_2490 &&
+			    owusb_dev_count < MAX_USBDEVS) {
+				owusb_devs[owusb_dev_count].device = dev;
+				owusb_devs[owusb_dev_count].handle = NULL;
+				owusb_dev_count++;
 			}
 		}
 	}
-	return 0;
+	owusb_enumerated = 1;
+	return owusb_dev_count;
 }
 
 /*
- * Finalize the owusb library.
+ * Find an adapter by its USB path, the bus and device directories as
+ * in /dev/bus/usb, e.g. "001/004". The device number changes when the
+ * adapter is plugged in again.
+ *
+ * Returns: index of the adapter, -1 if there is no such adapter
+ */
+
+int
+owusb_find(const char *path)
+{
+	struct usb_device *dev;
+	int n, i;
+
+	for (i = 0; i < owusb_enumerate(); i++) {
+		dev = owusb_devs[i].device;
+		n = strlen(dev->bus->dirname);
+		if (strncmp(path, dev->bus->dirname, n) == 0 && path[n] == '/' &&
+		    strcmp(path + n + 1, dev->filename) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Open a single adapter, enumerating the adapters first if needed. An
+ * adapter that is already open is returned as is, so tools using one
+ * adapter do not pay for opening the others.
+ *
+ * With warm set, an adapter that is already in the mode it is used in
+ * keeps its state and is not reset; the warm flag of the adapter tells
+ * whether the reset was skipped.
+ *
+ * Returns: the adapter, NULL if there is no such adapter or it could
+ * not be opened
+ */
+
+owusb_device_t *
+owusb_attach(int i, int warm)
+{
+	if (i < 0 || i >= owusb_enumerate()) {
+		return NULL;
+	}
+	if (owusb_devs[i].handle == NULL &&
+	    owusb_init_dev(i, owusb_devs[i].device, warm) != 0) {
+		return NULL;
+	}
+	return &owusb_devs[i];
+}
+
+/* Open and reset a single adapter */
+owusb_device_t *
+owusb_open(int i)
+{
+	return owusb_attach(i, 0);
+}
+
+struct owusb_opener {
+	pthread_t thread;
+	int started;
+	int i;
+	int warm;
+	int r;
+};
+
+static void *
+owusb_open_thread(void *arg)
+{
+	struct owusb_opener *o = arg;
+
+	o->r = owusb_init_dev(o->i, owusb_devs[o->i].device, o->warm);
+	return NULL;
+}
+
+/*
+ * Open all adapters in parallel, each on its own thread, as the
+ * resets and the USB setup of each adapter take several round trips.
+ *
+ * @param warm Skip the reset of adapters already in the right mode
+ *
+ * Returns: 0 on success, the error of the first adapter that failed
+ * otherwise
+ */
+
+int
+owusb_attach_all(int warm)
+{
+	struct owusb_opener o[MAX_USBDEVS];
+	int e = 0;
+	int i;
+
+	owusb_enumerate();
+	for (i = 0; i < owusb_dev_count; i++) {
+		o[i].i = i;
+		o[i].warm = warm;
+		o[i].r = 0;
+		o[i].started = 0;
+		if (owusb_devs[i].handle != NULL) {
+			continue;
+		}
+		if (pthread_create(&o[i].thread, NULL, owusb_open_thread, &o[i]) == 0) {
+			o[i].started = 1;
+		} else {
+			/* Open it here instead */
+			owusb_open_thread(&o[i]);
+		}
+	}
+	for (i = 0; i < owusb_dev_count; i++) {
+		if (o[i].started) {
+			pthread_join(o[i].thread, NULL);
+		}
+		if (o[i].r != 0 && e == 0) {
+			e = o[i].r;
+		}
+	}
+	return e;
+}
+
+/*
+ * Initalize the owusb library and open and reset all adapters. Either
+ * this function, owusb_attach_all() or owusb_open() must be called
+ * before any other function.
+ *
+ * Returns: 0 on success, < 0 on failure
+ */
+
+int
+owusb_init(void)
+{
+	return owusb_attach_all(0);
+}
+
+/*
+ * Finalize the owusb library, closing all open adapters.
  */
 
 void
 owusb_fini(void)
 {
+	int i;
 
+	for (i = 0; i < owusb_dev_count; i++) {
+		if (owusb_devs[i].handle) {
+			usb_release_interface(owusb_devs[i].handle, 0);
+			usb_close(owusb_devs[i].handle);
+			owusb_devs[i].handle = NULL;
+		}
+	}
 }
 
 
 void
 owusb_interrupt_read(owusb_device_t *dev)
 {
+	OWPROBE3(xfer_submit, dev - owusb_devs, 1, INTERRUPT_DATA_LEN);
 	dev->interrupt_len = usb_interrupt_read(dev->handle,
 						USB_ENDPOINT_TYPE_ISOCHRONOUS, 
 						(char *)dev->interrupt_data,
 						INTERRUPT_DATA_LEN, 
 						dev->timeout);
 	dev->interrupt_count++;
+	OWPROBE3(xfer_complete, dev - owusb_devs, 1, dev->interrupt_len);
+	OWPROBE4(status, dev - owusb_devs, dev->interrupt_len,
+		 dev->interrupt_data[STATE_STATUS_FLAGS],
+		 dev->interrupt_data[STATE_DATA_IN_BUFFER_STATUS]);
 }
 
 
 int
 owusb_write(owusb_device_t *dev, const uint8_t *data, int len)
 {
-	return usb_bulk_write(dev->handle, USB_ENDPOINT_TYPE_BULK,
+	int r;
+
+	OWPROBE3(xfer_submit, dev - owusb_devs, 2, len);
+	r = usb_bulk_write(dev->handle, USB_ENDPOINT_TYPE_BULK,
 			(char *)data, len, dev->timeout);
+	if (r > 0) dev->ep2_bytes += r;
+	OWPROBE3(xfer_complete, dev - owusb_devs, 2, r);
+	return r;
 }
 
 int
 owusb_read(owusb_device_t *dev, uint8_t *data, int len)
 {
-	return usb_bulk_read(dev->handle, USB_ENDPOINT_TYPE_INTERRUPT,
+	int r;
+
+	OWPROBE3(xfer_submit, dev - owusb_devs, 3, len);
+	r = usb_bulk_read(dev->handle, USB_ENDPOINT_TYPE_INTERRUPT,
 			(char *)data, len, dev->timeout);
+	if (r > 0) dev->ep3_bytes += r;
+	OWPROBE3(xfer_complete, dev - owusb_devs, 3, r);
+	return r;
 }
 
 /* Wait for a command to complete */
 void
 owusb_wait_until_idle(owusb_device_t *dev)
 {
+	unsigned gen = dev->cancel_gen;
+
 	owusb_interrupt_read(dev);
-	while (!owusb_isidle(dev)){
+	while (!owusb_isidle(dev) && dev->cancel_gen == gen) {
 		owusb_interrupt_read(dev);	
 	};
 }
@@ -788,12 +999,72 @@ owusb_wait_until_idle(owusb_device_t *dev)
 void
 owusb_wait_for_presence(owusb_device_t *dev)
 {
+	unsigned gen = dev->cancel_gen;
+
 	owusb_interrupt_read(dev);
-	while (owusb_result(dev) != 0xa5) {
+	while (!(owusb_result(dev) & RESULT_XDETECT) && dev->cancel_gen == gen) {
 		owusb_interrupt_read(dev);
 	}
 }
 
+/*
+ * Bring the adapter back to a clean state after a transaction was
+ * abandoned: stop command processing once the bus is idle, drop all
+ * queued commands and the data in both FIFOs, and resume.
+ *
+ * Returns: 0 on success, OWUSB_EIO if a control transfer failed
+ */
+int
+owusb_recover(owusb_device_t *dev)
+{
+	if (owusb_ctl_halt_exe_idle(dev) < 0 ||
+	    owusb_ctl_flush_comm_cmds(dev) < 0 ||
+	    owusb_ctl_flush_xmt_buffer(dev) < 0 ||
+	    owusb_ctl_flush_rcv_buffer(dev) < 0 ||
+	    owusb_ctl_resume_exe(dev) < 0) {
+		return OWUSB_EIO;
+	}
+	return 0;
+}
+
+/*
+ * Cancel the transaction in flight, if any. This may be called from
+ * another thread than the one running the transaction, which then
+ * returns OWUSB_ECANCEL, or an error, as soon as its current USB
+ * transfer has completed. The adapter is recovered and the bus reset,
+ * so slaves cut off in the middle of a command start over. The time
+ * until the adapter is idle again is left in cancel_latency.
+ *
+ * Returns: 0 on success, OWUSB_EIO if the adapter could not be
+ * recovered
+ */
+int
+owusb_cancel(owusb_device_t *dev)
+{
+	uint8_t state[INTERRUPT_DATA_LEN];
+	uint64_t start = monotonic_ns();
+	int i;
+
+	dev->cancel_gen++;
+	if (owusb_recover(dev) != 0) {
+		return OWUSB_EIO;
+	}
+	owusb_com_reset(dev, PARAM_IM, 0, 0);
+	/* Poll into a buffer of our own, the transaction thread reads dev's */
+	for (i = 0; i < 100; i++) {
+		if (usb_interrupt_read(dev->handle, USB_ENDPOINT_TYPE_ISOCHRONOUS,
+				       (char *)state, INTERRUPT_DATA_LEN,
+				       dev->timeout) > STATE_STATUS_FLAGS &&
+		    state[STATE_STATUS_FLAGS] & 0x20) {
+			break;
+		}
+	}
+	dev->cancel_latency = monotonic_ns() - start;
+	owlog(OWLOG_INFO, "adapter %ld: cancelled in %lu us",
+	      dev - owusb_devs, dev->cancel_latency / 1000);
+	return 0;
+}
+
 
 int
 owusb_datain(owusb_device_t *dev)
@@ -814,12 +1085,13 @@ owusb_result(owusb_device_t *dev)
 	uint16_t result = 0;
 
 	for (i = 16; i < dev->interrupt_len; i++) {
-		if (dev->interrupt_data[STATE_COMBYTE2] == RESULT_DETECT) {
+		if (dev->interrupt_data[i] == RESULT_DETECT) {
 			result |= RESULT_XDETECT;
 		} else {
 			result |= dev->interrupt_data[i];
 		}
 	}
+	OWPROBE2(result, dev - owusb_devs, result);
 	return result;
 }
 
@@ -833,6 +1105,7 @@ owusb_presence_detect(owusb_device_t *dev)
 	return r & RESULT_XDETECT;
 }
 
+#ifndef OWUSB_NO_STDIO
 void 
 owusb_print_state(owusb_device_t *dev)
 {
@@ -865,11 +1138,13 @@ owusb_print_result(owusb_device_t *dev)
 		printf("Result: %02x\n", dev->interrupt_data[i]);
 	}
 }
+#endif
 
 int
 owusb_search(owusb_device_t *dev, uint8_t type, uint8_t *data, int len)
 {
 	uint8_t zeros[8];
+	unsigned gen;
 	int r;
 
 	memset(zeros, 0, 8);
@@ -877,6 +1152,7 @@ owusb_search(owusb_device_t *dev, uint8_t type, uint8_t *data, int len)
 	if (r < 0) {
 	  return r;
 	}
+	gen = dev->cancel_gen;
 	/* no discrepancy, no access, no device limit */
 	r = owusb_com_search_access(dev, PARAM_F | PARAM_RST | PARAM_IM, 0, 1, 0, type);
 	if (r < 0) {
@@ -888,6 +1164,9 @@ owusb_search(owusb_device_t *dev, uint8_t type, uint8_t *data, int len)
 	usleep(3 * 64 * FLEXIBLE_SLOT_US);
 	owusb_interrupt_read(dev);
 	while (!owusb_isidle(dev)) {
+		if (dev->cancel_gen != gen) {
+			return OWUSB_ECANCEL;
+		}
 		/* If are not idle, then there is probably more ROMs to read */
 		usleep(3 * 64 * FLEXIBLE_SLOT_US);
 	       
@@ -958,6 +1237,7 @@ owusb_search_next(owusb_device_t *dev, uint8_t *data)
 	usleep(REGULAR_RESET_US + 3 * 64 * FLEXIBLE_SLOT_US + 100);
 	/*owusb_interrupt_read(dev);*/
 	r = owusb_read(dev, disc, 16);
+	OWPROBE3(search_step, dev - owusb_devs, r, disc);
 	if (r < 8) {
 		dev->search_stop = 1;
 		return 0;
@@ -965,7 +1245,7 @@ owusb_search_next(owusb_device_t *dev, uint8_t *data)
 	memcpy(data, disc, 8);
 	if (r == 16) {
 		for (i = 7; i >= 0; i--) {
-			/*printf("disc: %02x\n", disc[i]);*/
+			owlog(OWLOG_DEBUG, "search: byte %ld discrepancy %02lx", i, disc[i + 8]);
 			if (disc[i] && !set) {
 				b = compare(disc[i + 8], disc[i]);
 				if (b) {
@@ -1021,6 +1301,26 @@ owusb_reset(owusb_device_t *dev)
 	return owusb_result(dev);
 }
 
+/*
+ * Enable the strong pullup used by the spu argument of the block
+ * functions and set its duration. The duration is rounded up to the
+ * 16ms resolution of the DS2490. A duration of 0 disables the strong
+ * pullup.
+ */
+int
+owusb_strong_pullup(owusb_device_t *dev, int ms)
+{
+	int r;
+
+	if (ms <= 0) {
+		return owusb_mod_pulse_en(dev, 0);
+	}
+	if ((r = owusb_mod_strong_pu_duration(dev, (ms + 15) / 16)) < 0) {
+		return r;
+	}
+	return owusb_mod_pulse_en(dev, PARAM_SPUE);
+}
+
 
 /*
  * Send a command to a device
@@ -1034,13 +1334,206 @@ int
 owusb_cmd(owusb_device_t *dev, const uint8_t* addr, uint8_t cmd, uint8_t *out, int outlen)
 {
 	uint8_t cmdbuf[10];
+	int r;
 	
 	cmdbuf[0] = WIRE_CMD_MATCH_ROM;
 	memcpy(&cmdbuf[1], addr, 8);
 	cmdbuf[9] = cmd;
-	owusb_write(dev, cmdbuf, 10);
-	owusb_com_read_straight(dev, PARAM_RST | PARAM_IM, 10, outlen);
-	return owusb_read(dev, out, outlen);
+	r = owusb_read_straight(dev, cmdbuf, 10, out, outlen, 1);
+	return r < 0 ? r : outlen;
+}
+
+
+/*
+ * Write a command and read a fixed number of bytes in a single READ
+ * STRAIGHT command. Unlike owusb_block_io() only the command is sent
+ * over EP2 and only the read bytes come back over EP3, so the host
+ * neither pads the read with 0xff nor compares the echo. Use this for
+ * all fixed format reads, e.g. scratchpads, counters and memory.
+ *
+ * @param writedata Command, normally starting with a ROM command
+ * @param writedatalen Length of the command, at most 255 bytes
+ * @param readdata Buffer for the data read
+ * @param readdatalen Number of bytes to read
+ * @param reset Reset the bus before the command
+ *
+ * Returns: 0 on success, OWUSB_EIO if a transfer failed,
+ * OWUSB_ESHORT if not all bytes could be read or OWUSB_ECANCEL
+ */
+int
+owusb_read_straight(owusb_device_t *dev,
+		    const uint8_t *writedata, int writedatalen,
+		    uint8_t *readdata, int readdatalen, int reset)
+{
+	unsigned gen = dev->cancel_gen;
+	int flags = PARAM_IM;
+	int sleeplen = 0;
+	int len = 0;
+	int r = 0;
+
+	if (writedatalen > 0xff || readdatalen > DS2490_FIFOSIZE) {
+		return OWUSB_EIO;
+	}
+	if (reset) {
+		flags |= PARAM_RST;
+		sleeplen = REGULAR_RESET_US;
+	}
+	OWPROBE4(block_start, dev - owusb_devs, COM_READ_STRAIGHT, 1, writedatalen + readdatalen);
+	if (owusb_write(dev, writedata, writedatalen) != writedatalen ||
+	    owusb_com_read_straight(dev, flags, writedatalen, readdatalen) < 0) {
+		OWPROBE4(block_end, dev - owusb_devs, COM_READ_STRAIGHT, 1, OWUSB_EIO);
+		return OWUSB_EIO;
+	}
+	usleep(sleeplen + (writedatalen + readdatalen) * 8 * FLEXIBLE_SLOT_US);
+	/* The data may arrive in more than one packet */
+	while (len < readdatalen) {
+		if (dev->cancel_gen != gen) {
+			r = OWUSB_ECANCEL;
+			break;
+		}
+		r = owusb_read(dev, readdata + len, readdatalen - len);
+		if (r <= 0) {
+			owlog(OWLOG_DEBUG, "adapter %ld: read straight got %ld of %ld bytes",
+			      dev - owusb_devs, len, readdatalen);
+			r = r < 0 ? OWUSB_EIO : OWUSB_ESHORT;
+			break;
+		}
+		len += r;
+		r = 0;
+	}
+	OWPROBE4(block_end, dev - owusb_devs, COM_READ_STRAIGHT, 1, r);
+	return r;
+}
+
+/*
+ * Run count READ STRAIGHT transactions back to back, each with a
+ * reset, writing writedatalen bytes and reading readdatalen bytes.
+ * All write data and commands are queued at once and the adapter
+ * runs them in order. Instead of waiting for the whole batch, the
+ * fill level of the receive FIFO is watched on the interrupt endpoint
+ * and each transaction is passed to ready as soon as all its bytes
+ * have arrived.
+ *
+ * @param writedata count * writedatalen bytes
+ * @param readdata Buffer of count * readdatalen bytes
+ * @param ready Called with the index and the read data of each
+ * transaction, in order
+ *
+ * Returns: number of transactions completed, which is less than count
+ * if the data stopped arriving or the batch was cancelled, or
+ * OWUSB_EIO if the batch does not fit in the FIFOs or a transfer failed,
+ * in which case transactions may already have been passed to ready.
+ * Whatever is left of a failed batch is flushed from the adapter.
+ */
+int
+owusb_read_straight_batch(owusb_device_t *dev,
+			  const uint8_t *writedata, int writedatalen,
+			  uint8_t *readdata, int readdatalen, int count,
+			  void (*ready)(int i, uint8_t *data, void *arg), void *arg)
+{
+	unsigned gen = dev->cancel_gen;
+	int total = count * readdatalen;
+	int got = 0;
+	int done = 0;
+	int avail;
+	int r;
+	int i;
+	uint64_t end;
+
+	if (count <= 0 || count > DS2490_CMD_FIFOSIZE || writedatalen > 0xff ||
+	    count * writedatalen > DS2490_FIFOSIZE || total > DS2490_FIFOSIZE) {
+		return OWUSB_EIO;
+	}
+	OWPROBE4(block_start, dev - owusb_devs, COM_READ_STRAIGHT, count,
+		 count * (writedatalen + readdatalen));
+	if (owusb_write(dev, writedata, count * writedatalen) != count * writedatalen) {
+		owusb_recover(dev);
+		OWPROBE4(block_end, dev - owusb_devs, COM_READ_STRAIGHT, count, OWUSB_EIO);
+		return OWUSB_EIO;
+	}
+	for (i = 0; i < count; i++) {
+		if (owusb_com_read_straight(dev, PARAM_IM | PARAM_RST, writedatalen, readdatalen) < 0) {
+			owusb_recover(dev);
+			OWPROBE4(block_end, dev - owusb_devs, COM_READ_STRAIGHT, count, OWUSB_EIO);
+			return OWUSB_EIO;
+		}
+	}
+	/* Twice the time on the wire before giving up */
+	end = monotonic_ns() + 2000ULL * count *
+		(REGULAR_RESET_US + (writedatalen + readdatalen) * 8 * REGULAR_SLOT_US);
+	while (done < count && dev->cancel_gen == gen) {
+		owusb_interrupt_read(dev);
+		avail = dev->interrupt_len > STATE_DATA_IN_BUFFER_STATUS ? owusb_datain(dev) : 0;
+		if (avail == 0) {
+			if (monotonic_ns() > end) {
+				/* Do not leave the rest to the next transaction */
+				owlog(OWLOG_WARN, "adapter %ld: batch timed out after %ld of %ld",
+				      dev - owusb_devs, done, count);
+				owusb_recover(dev);
+				break;
+			}
+			continue;
+		}
+		if (avail > total - got) {
+			avail = total - got;
+		}
+		if ((r = owusb_read(dev, readdata + got, avail)) < 0) {
+			/* Do not leave the queued commands and data to the next batch */
+			owusb_recover(dev);
+			OWPROBE4(block_end, dev - owusb_devs, COM_READ_STRAIGHT, count, OWUSB_EIO);
+			return OWUSB_EIO;
+		}
+		got += r;
+		while (done < got / readdatalen) {
+			ready(done, readdata + done * readdatalen, arg);
+			done++;
+		}
+	}
+	OWPROBE4(block_end, dev - owusb_devs, COM_READ_STRAIGHT, count, done);
+	return done;
+}
+
+
+/*
+ * Write a block to the 1-Wire bus and read back what was seen on the
+ * wire into the same buffer. Positions that are to be read from the
+ * bus should be set to 0xff. This allows reads and writes to be
+ * interleaved in a single transfer.
+ *
+ * Returns: number of bytes read back, < 0 on failure
+ */
+int
+owusb_block_rw(owusb_device_t *dev, uint8_t *data, int len, int reset, int spu)
+{
+	unsigned gen = dev->cancel_gen;
+	int flags = PARAM_IM;
+	int sleeplen = 0;
+	int r;
+
+	if (len > DS2490_FIFOSIZE) {
+		return OWUSB_EIO;
+	}
+	if (reset) {
+		flags |= PARAM_RST;
+		sleeplen = REGULAR_RESET_US;
+	}
+	if (spu) flags |= PARAM_SPU;
+
+	OWPROBE4(block_start, dev - owusb_devs, COM_BLOCK_IO, 1, len);
+	if (owusb_write(dev, data, len) < 0 ||
+	    owusb_com_block_io(dev, flags, len) < 0) {
+		OWPROBE4(block_end, dev - owusb_devs, COM_BLOCK_IO, 1, OWUSB_EIO);
+		return OWUSB_EIO;
+	}
+	usleep(sleeplen + len * 8 * FLEXIBLE_SLOT_US);
+	/* A cancel flushed the data, do not wait for it */
+	if (dev->cancel_gen != gen) {
+		OWPROBE4(block_end, dev - owusb_devs, COM_BLOCK_IO, 1, OWUSB_ECANCEL);
+		return OWUSB_ECANCEL;
+	}
+	r = owusb_read(dev, data, len);
+	OWPROBE4(block_end, dev - owusb_devs, COM_BLOCK_IO, 1, r);
+	return r;
 }
 
 
@@ -1051,6 +1544,7 @@ owusb_block_io(owusb_device_t *dev,
 	       int reset, int spu) 
 {
 	uint8_t tmpbuf[DS2490_FIFOSIZE];
+	unsigned gen = dev->cancel_gen;
 	int flags = PARAM_IM;
 	int datalen = writedatalen + readdatalen;
 	int sleeplen = 0;
@@ -1063,6 +1557,7 @@ owusb_block_io(owusb_device_t *dev,
 	}
 	if (spu) flags |= PARAM_SPU;
 	
+	OWPROBE4(block_start, dev - owusb_devs, COM_BLOCK_IO, 1, datalen);
 	if (writedatalen > 0) { 
 		owusb_write(dev, writedata, writedatalen);
 	}
@@ -1074,15 +1569,22 @@ owusb_block_io(owusb_device_t *dev,
 	owusb_com_block_io(dev, flags, datalen);
 	sleeplen += datalen * 8 * FLEXIBLE_SLOT_US;
 	usleep(sleeplen);
+	if (dev->cancel_gen != gen) {
+		OWPROBE4(block_end, dev - owusb_devs, COM_BLOCK_IO, 1, OWUSB_ECANCEL);
+		return OWUSB_ECANCEL;
+	}
 	owusb_read(dev, tmpbuf, DS2490_FIFOSIZE);
 	if (writedatalen > 0) {
 		/* Verify that the same bits we wrote were seen on the wire */
 		if (memcmp(tmpbuf, writedata, writedatalen) != 0) {
+			owlog(OWLOG_DEBUG, "adapter %ld: block I/O echo mismatch", dev - owusb_devs);
+			OWPROBE4(block_end, dev - owusb_devs, COM_BLOCK_IO, 1, -1);
 			return -1;
 		}
 	}
 	if (readdatalen > 0) {
 		memcpy(readdata, &tmpbuf[writedatalen], readdatalen);
 	}
+	OWPROBE4(block_end, dev - owusb_devs, COM_BLOCK_IO, 1, 0);
 	return 0;
 }
@@ -1,7 +1,14 @@
 /* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
 
+#ifndef DS2490_H
+#define DS2490_H
+
 #include <stdint.h>
 
+/* Size of the data FIFOs of EP2 and EP3, and of the command FIFO */
+#define DS2490_FIFOSIZE 128
+#define DS2490_CMD_FIFOSIZE 16
+
 /*
  * Some findings:
  * Bit 0x8000 is always zero
@@ -60,6 +67,14 @@ enum {
 	RESULT_NRS = 0x01 /* No response */
 };
 
+/* Error codes returned by the higher level functions */
+enum {
+	OWUSB_EIO = -1,    /* USB transfer failed or echo mismatch */
+	OWUSB_ESHORT = -2, /* Fewer bytes than expected were read */
+	OWUSB_ECRC = -3,   /* CRC check of the read data failed */
+	OWUSB_ECANCEL = -4 /* Cancelled with owusb_cancel() */
+};
+
 enum {
 	STATE_EP0F = 0x80,
 	STATE_IDLE = 0x20,
@@ -127,6 +142,11 @@ typedef struct owusb_device {
 	uint8_t search_cmd;
 	uint8_t last_bit;
 	uint8_t last_byte;
+	unsigned long ep2_bytes; /* Bytes sent to the 1-Wire bus */
+	unsigned long ep3_bytes; /* Bytes received from the 1-Wire bus */
+	volatile unsigned cancel_gen; /* Bumped by every owusb_cancel() */
+	uint64_t cancel_latency; /* ns the last owusb_cancel() took */
+	int warm;                /* Attached without a reset */
 } owusb_device_t;
 
 extern owusb_device_t owusb_devs[];
@@ -168,6 +188,11 @@ int owusb_com_read_redirect_page(owusb_device_t *d, int params, int page_number,
 int owusb_com_search_access(owusb_device_t *d, int params, int discrepancy, int noaccess, int device_count, int cmd);
 
 int owusb_init(void);
+int owusb_enumerate(void);
+int owusb_find(const char *path);
+owusb_device_t *owusb_open(int i);
+owusb_device_t *owusb_attach(int i, int warm);
+int owusb_attach_all(int warm);
 void owusb_fini(void);
 
 int  owusb_search_all(owusb_device_t *dev, uint8_t *data, int len);
@@ -180,13 +205,24 @@ void owusb_wait_for_presence(owusb_device_t *dev);
 int  owusb_datain(owusb_device_t *dev);
 int  owusb_isidle(owusb_device_t *dev);
 uint16_t owusb_result(owusb_device_t *dev);
+/* Not available when built with OWUSB_NO_STDIO */
 void owusb_print_state(owusb_device_t *dev);
 void owusb_print_result(owusb_device_t *dev);
 int  owusb_cmd(owusb_device_t *dev, const uint8_t* addr, uint8_t cmd, uint8_t *out, int outlen);
 int  owusb_write_byte(owusb_device_t *dev, uint8_t byte);
 int  owusb_read_bit(owusb_device_t *dev);
 uint16_t owusb_reset(owusb_device_t *dev);
+int owusb_strong_pullup(owusb_device_t *dev, int ms);
+int owusb_recover(owusb_device_t *dev);
+int owusb_cancel(owusb_device_t *dev);
+int owusb_read_straight(owusb_device_t *dev, const uint8_t *writedata, int writedatalen, uint8_t *readdata, int readdatalen, int reset);
+int owusb_read_straight_batch(owusb_device_t *dev, const uint8_t *writedata, int writedatalen,
+			      uint8_t *readdata, int readdatalen, int count,
+			      void (*ready)(int i, uint8_t *data, void *arg), void *arg);
+int owusb_block_rw(owusb_device_t *dev, uint8_t *data, int len, int reset, int spu);
 int owusb_block_io(owusb_device_t *dev, const uint8_t *writedata, int writedatalen,  uint8_t *readdata, int readdatalen,  int reset, int spu);
 int owusb_presence_detect(owusb_device_t *dev);
 int owusb_search_first(owusb_device_t *dev, uint8_t type, uint8_t *data);
 int owusb_search_next(owusb_device_t *dev, uint8_t *data);
+
+#endif
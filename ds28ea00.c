@@ -0,0 +1,93 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#include <string.h>
+#include "ds28ea00.h"
+#include "util.h"
+
+#define DS28EA00_CMD_CHAIN 0x99
+#define DS28EA00_CMD_COND_READ_ROM 0x0f
+#define DS28EA00_CHAIN_CONFIRM 0xaa
+
+
+/*
+ * Send a chain control command to all devices on the bus.
+ *
+ * @param ctl DS28EA00_CHAIN_OFF, DS28EA00_CHAIN_ON or
+ * DS28EA00_CHAIN_DONE
+ *
+ * Returns: 0 on success, < 0 on failure
+ */
+
+int
+ds28ea00_chain(owusb_device_t *dev, uint8_t ctl)
+{
+	uint8_t buf[5];
+
+	buf[0] = WIRE_CMD_SKIP_ROM;
+	buf[1] = DS28EA00_CMD_CHAIN;
+	buf[2] = ctl;
+	buf[3] = ~ctl;
+	buf[4] = 0xff;
+	if (owusb_block_rw(dev, buf, sizeof(buf), 1, 0) != sizeof(buf)) {
+		return OWUSB_EIO;
+	}
+	return buf[4] == DS28EA00_CHAIN_CONFIRM ? 0 : OWUSB_EIO;
+}
+
+/*
+ * Discover the DS28EA00 devices of a daisy chain in physical order.
+ *
+ * With chain mode on, the Conditional Read ROM command is answered
+ * only by the first device whose EN input is active and that has not
+ * yet been marked done. Marking it done enables the next device in
+ * the chain. Each position is read with a single transfer holding the
+ * Conditional Read ROM, the ROM itself and the Chain Done command,
+ * which is considerably faster than a binary ROM search.
+ *
+ * @param roms Array receiving the ROMs, first device first
+ * @param max Size of the array
+ *
+ * Returns: number of devices found, < 0 on failure
+ */
+
+int
+ds28ea00_chain_discover(owusb_device_t *dev, uint8_t (*roms)[8], int max)
+{
+	uint8_t buf[13];
+	uint8_t *rom = &buf[1];
+	static const uint8_t none[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	int n = 0;
+	int r;
+
+	if ((r = ds28ea00_chain(dev, DS28EA00_CHAIN_ON)) != 0) {
+		return r;
+	}
+	while (n < max) {
+		buf[0] = DS28EA00_CMD_COND_READ_ROM;
+		memset(rom, 0xff, 8);
+		buf[9] = DS28EA00_CMD_CHAIN;
+		buf[10] = DS28EA00_CHAIN_DONE;
+		buf[11] = (uint8_t)~DS28EA00_CHAIN_DONE;
+		buf[12] = 0xff;
+		if (owusb_block_rw(dev, buf, sizeof(buf), 1, 0) != sizeof(buf)) {
+			r = OWUSB_EIO;
+			break;
+		}
+		if (memcmp(rom, none, 8) == 0) {
+			/* Nobody answered, end of chain */
+			break;
+		}
+		if (calc_crc8(rom, 7) != rom[7]) {
+			r = OWUSB_ECRC;
+			break;
+		}
+		if (buf[12] != DS28EA00_CHAIN_CONFIRM) {
+			r = OWUSB_EIO;
+			break;
+		}
+		memcpy(roms[n++], rom, 8);
+	}
+	/* Always leave chain mode, even after a failure */
+	ds28ea00_chain(dev, DS28EA00_CHAIN_OFF);
+	return r < 0 ? r : n;
+}
@@ -0,0 +1,21 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef DS28EA00_H
+#define DS28EA00_H
+
+#include <stdint.h>
+#include "ds2490.h"
+
+#define DS28EA00_FAMILY 0x42
+
+/* Chain control codes, each is sent followed by its complement */
+enum {
+	DS28EA00_CHAIN_OFF = 0x3c,
+	DS28EA00_CHAIN_ON = 0x5a,
+	DS28EA00_CHAIN_DONE = 0x96
+};
+
+int ds28ea00_chain(owusb_device_t *dev, uint8_t ctl);
+int ds28ea00_chain_discover(owusb_device_t *dev, uint8_t (*roms)[8], int max);
+
+#endif
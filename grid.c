@@ -0,0 +1,317 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Time aligned sampling
+ *
+ * Conversions on all adapters are started at fixed slots on an
+ * absolute time grid. The slots are kept on the monotonic clock using
+ * clock_nanosleep() with TIMER_ABSTIME, so a late cycle never shifts
+ * the following ones. The grid is aligned with the wall clock when it
+ * is set up, e.g. a 1 s period starts every whole second.
+ *
+ * The grid can be run on its own acquisition thread, optionally in
+ * real-time mode: pinned to a CPU, scheduled with SCHED_FIFO and with
+ * all memory locked and prefaulted. The engines keep all their state
+ * in preallocated structs, so the cycle itself neither allocates nor
+ * uses stdio.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "grid.h"
+#include "util.h"
+
+/* Stack prefaulted by the acquisition thread */
+#define OWGRID_STACK_PREFAULT (64 * 1024)
+
+static void
+owgrid_sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Put the next slot on the grid, aligned with the wall clock */
+static void
+owgrid_init_slot(owgrid_t *g)
+{
+	owtime_t now;
+
+	owtime_now(&now);
+	g->clock_offset = now.wall - now.mono;
+	g->next = now.mono + g->period - now.wall % g->period;
+}
+
+/*
+ * @param period Time between slots in ns
+ *
+ * Returns: 0 on success, -1 if the period is 0
+ */
+
+int
+owgrid_init(owgrid_t *g, uint64_t period)
+{
+	memset(g, 0, sizeof(*g));
+	if (period == 0) {
+		return -1;
+	}
+	g->period = period;
+	owgrid_init_slot(g);
+	return 0;
+}
+
+int
+owgrid_add(owgrid_t *g, owacq_t *a)
+{
+	if (g->nacq >= OWGRID_MAX_ACQ) {
+		return -1;
+	}
+	g->acq[g->nacq] = a;
+	a->period = g->period;
+	return g->nacq++;
+}
+
+static void
+owgrid_record(owgrid_t *g, int64_t offset)
+{
+	owgrid_stats_t *s = &g->stats;
+
+	s->samples[s->pos] = offset;
+	s->pos = (s->pos + 1) % OWGRID_SAMPLES;
+	if (s->nsamples < OWGRID_SAMPLES) {
+		s->nsamples++;
+	}
+	s->offset_sum += offset;
+	if (offset > s->offset_max) {
+		s->offset_max = offset;
+	}
+}
+
+/*
+ * Sleep until the next slot and run one cycle on all adapters. The
+ * conversions are started back to back on every adapter before any
+ * of them is waited for or read.
+ *
+ * Returns: number of devices read successfully
+ */
+
+int
+owgrid_step(owgrid_t *g)
+{
+	owtime_t now;
+	int64_t offset;
+	uint64_t slot = g->next;
+	int i;
+	int ok = 0;
+
+	owgrid_sleep_until(slot);
+	/* Without adapters this is just the wakeup latency */
+	offset = monotonic_ns() - slot;
+	for (i = 0; i < g->nacq; i++) {
+		owacq_convert(g->acq[i]);
+	}
+	for (i = 0; i < g->nacq; i++) {
+		if ((int64_t)(g->acq[i]->convert.mono - slot) > offset) {
+			offset = g->acq[i]->convert.mono - slot;
+		}
+	}
+	owgrid_record(g, offset);
+
+	for (i = 0; i < g->nacq; i++) {
+		if (owacq_wait_convert(g->acq[i]) == 0) {
+			ok += owacq_collect(g->acq[i]);
+		}
+	}
+
+	owtime_now(&now);
+	g->stats.clock_drift = (int64_t)(now.wall - now.mono) - g->clock_offset;
+	g->stats.cycles++;
+	g->next += g->period;
+	while (g->next <= now.mono) {
+		g->next += g->period;
+		g->stats.overruns++;
+	}
+	return ok;
+}
+
+/* Touch the stack and the engine state so no page faults hit the loop */
+static void
+owgrid_touch(volatile uint8_t *p, size_t len)
+{
+	size_t off;
+
+	for (off = 0; off < len; off += 4096) {
+		p[off] = p[off];
+	}
+}
+
+static void
+owgrid_prefault(owgrid_t *g)
+{
+	volatile uint8_t stack[OWGRID_STACK_PREFAULT];
+	int i;
+
+	owgrid_touch(stack, sizeof(stack));
+	owgrid_touch((volatile uint8_t *)g, sizeof(*g));
+	for (i = 0; i < g->nacq; i++) {
+		owgrid_touch((volatile uint8_t *)g->acq[i], sizeof(owacq_t));
+	}
+}
+
+static void *
+owgrid_thread(void *arg)
+{
+	owgrid_t *g = arg;
+	uint64_t n;
+
+	owgrid_prefault(g);
+	for (n = 0; !g->stop && (g->cycles == 0 || n < g->cycles); n++) {
+		owgrid_step(g);
+		if (g->cycle) {
+			g->cycle(g, g->arg);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Run the grid on a new acquisition thread.
+ *
+ * @param rt Real-time settings, NULL to run as a normal thread
+ *
+ * Returns: 0 on success, an errno value on failure, typically EPERM
+ * if real-time scheduling or memory locking is not permitted
+ */
+
+int
+owgrid_start(owgrid_t *g, const owgrid_rt_t *rt)
+{
+	pthread_attr_t attr;
+	struct sched_param sp;
+	cpu_set_t cpus;
+	int r;
+
+	g->stop = 0;
+	pthread_attr_init(&attr);
+	if (rt && rt->lock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		pthread_attr_destroy(&attr);
+		return errno;
+	}
+	if (rt && rt->priority > 0) {
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = rt->priority;
+		pthread_attr_setschedparam(&attr, &sp);
+	}
+	if (rt && rt->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(rt->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	/* The slots are computed from now, not from when the grid was set up */
+	owgrid_init_slot(g);
+	r = pthread_create(&g->thread, &attr, owgrid_thread, g);
+	pthread_attr_destroy(&attr);
+	return r;
+}
+
+/* Ask the acquisition thread to stop after the current cycle */
+void
+owgrid_stop(owgrid_t *g)
+{
+	g->stop = 1;
+}
+
+/*
+ * Stop the acquisition thread without waiting for the current cycle,
+ * by cancelling what is in flight on every adapter.
+ */
+void
+owgrid_abort(owgrid_t *g)
+{
+	int i;
+
+	g->stop = 1;
+	for (i = 0; i < g->nacq; i++) {
+		owusb_cancel(g->acq[i]->dev);
+	}
+}
+
+void
+owgrid_join(owgrid_t *g)
+{
+	pthread_join(g->thread, NULL);
+}
+
+/*
+ * Find the k:th smallest value by partitioning in place. Unlike
+ * qsort(), which may allocate a buffer for arrays of this size, this
+ * is safe to call from the acquisition thread.
+ */
+static int64_t
+owgrid_select(int64_t *v, int n, int k)
+{
+	int lo = 0, hi = n - 1;
+	int i, j;
+	int64_t pivot, t;
+
+	while (lo < hi) {
+		pivot = v[lo + (hi - lo) / 2];
+		i = lo;
+		j = hi;
+		while (i <= j) {
+			while (v[i] < pivot) i++;
+			while (v[j] > pivot) j--;
+			if (i <= j) {
+				t = v[i];
+				v[i++] = v[j];
+				v[j--] = t;
+			}
+		}
+		if (k <= j) {
+			hi = j;
+		} else if (k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+	return v[k];
+}
+
+/*
+ * Offset percentile over the last OWGRID_SAMPLES cycles.
+ *
+ * @param p Percentile, 0 - 100
+ */
+
+int64_t
+owgrid_percentile(owgrid_t *g, double p)
+{
+	int64_t v[OWGRID_SAMPLES];
+	int n = g->stats.nsamples;
+
+	if (n == 0) {
+		return 0;
+	}
+	memcpy(v, g->stats.samples, n * sizeof(v[0]));
+	return owgrid_select(v, n, p / 100 * (n - 1) + 0.5);
+}
+
+int64_t
+owgrid_mean_offset(owgrid_t *g)
+{
+	if (g->stats.cycles == 0) {
+		return 0;
+	}
+	return g->stats.offset_sum / (int64_t)g->stats.cycles;
+}
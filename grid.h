@@ -0,0 +1,70 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "acquire.h"
+
+#ifndef OWGRID_MAX_ACQ
+#define OWGRID_MAX_ACQ 16
+#endif
+
+/* Number of cycle offsets kept for the percentiles */
+#ifndef OWGRID_SAMPLES
+#define OWGRID_SAMPLES 1024
+#endif
+
+/*
+ * Timing statistics. The offset of a cycle is the time from its grid
+ * slot until the last adapter had its conversion started.
+ */
+typedef struct owgrid_stats {
+	uint64_t cycles;
+	uint64_t overruns;     /* Slots skipped since a cycle ran late */
+	int64_t offset_sum;
+	int64_t offset_max;
+	int64_t clock_drift;   /* Change of wall - monotonic since start */
+	int nsamples;
+	int pos;
+	int64_t samples[OWGRID_SAMPLES];
+} owgrid_stats_t;
+
+/* Real-time settings of the acquisition thread */
+typedef struct owgrid_rt {
+	int priority;          /* SCHED_FIFO priority, 0 for normal scheduling */
+	int cpu;               /* CPU to pin the thread to, < 0 for any */
+	int lock;              /* Lock all memory with mlockall() */
+} owgrid_rt_t;
+
+/* Adapters sampled on a shared absolute time grid */
+typedef struct owgrid {
+	owacq_t *acq[OWGRID_MAX_ACQ];
+	int nacq;
+	uint64_t period;       /* ns */
+	uint64_t next;         /* Monotonic time of the next slot */
+	int64_t clock_offset;  /* wall - monotonic at start */
+	owgrid_stats_t stats;
+	/*
+	 * Called on the acquisition thread after each cycle. It must
+	 * not block, allocate or use stdio in real-time mode.
+	 */
+	void (*cycle)(struct owgrid *g, void *arg);
+	void *arg;
+	uint64_t cycles;       /* Cycles to run, 0 for until stopped */
+	volatile int stop;
+	pthread_t thread;
+} owgrid_t;
+
+int  owgrid_init(owgrid_t *g, uint64_t period);
+int  owgrid_add(owgrid_t *g, owacq_t *a);
+int  owgrid_step(owgrid_t *g);
+int  owgrid_start(owgrid_t *g, const owgrid_rt_t *rt);
+void owgrid_stop(owgrid_t *g);
+void owgrid_abort(owgrid_t *g);
+void owgrid_join(owgrid_t *g);
+int64_t owgrid_percentile(owgrid_t *g, double p);
+int64_t owgrid_mean_offset(owgrid_t *g);
+
+#endif
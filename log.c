@@ -0,0 +1,380 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Asynchronous logging, see log.h
+ *
+ * Each thread claims a ring the first time it logs and gives it back
+ * when it exits. The owner only moves the head and the background
+ * thread only moves the tail, so no locks are needed. A ring given
+ * back is only reused once the background thread has drained it.
+ */
+
+#include "log.h"
+
+volatile int owlog_level = OWLOG_OFF;
+
+#ifndef OWUSB_NO_STDIO
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+
+/* Size of the buffer the background thread formats into */
+#define OWLOG_BUFSIZE 8192
+#define OWLOG_LINE 256
+
+struct owlog_ring {
+	owlog_record_t rec[OWLOG_RING];
+	volatile unsigned head;  /* Next record to write, moved by the owner */
+	volatile unsigned tail;  /* Next record to format, moved by the log thread */
+	volatile int used;       /* Claimed by a thread */
+	volatile int released;   /* Given back, reusable once drained */
+	volatile unsigned long dropped;
+	unsigned long reported;  /* Drops reported by the log thread */
+	double tokens;
+	uint64_t refill;
+};
+
+static struct owlog_ring owlog_rings[OWLOG_THREADS];
+static __thread struct owlog_ring *owlog_self;
+static pthread_key_t owlog_key;
+static pthread_once_t owlog_once = PTHREAD_ONCE_INIT;
+static volatile unsigned long owlog_unowned; /* Dropped without a ring */
+static unsigned long owlog_released_drops;   /* Dropped in rings reused since */
+
+static int owlog_rate = OWLOG_RATE;
+static int owlog_burst = OWLOG_BURST;
+
+static pthread_t owlog_thread;
+static int owlog_started;
+static volatile int owlog_stopping;
+static int owlog_fd = -1;
+static int64_t owlog_clock_offset;     /* Wall clock less monotonic, ns */
+
+static const char *const owlog_names[] = { "ERR", "WARN", "INFO", "DEBUG" };
+
+static void
+owlog_release(void *arg)
+{
+	struct owlog_ring *r = arg;
+
+	r->released = 1;
+}
+
+static void
+owlog_init_key(void)
+{
+	pthread_key_create(&owlog_key, owlog_release);
+}
+
+/* Claim a free ring for the calling thread */
+static struct owlog_ring *
+owlog_claim(void)
+{
+	struct owlog_ring *r;
+	int i;
+
+	pthread_once(&owlog_once, owlog_init_key);
+	for (i = 0; i < OWLOG_THREADS; i++) {
+		r = &owlog_rings[i];
+		if (__sync_bool_compare_and_swap(&r->used, 0, 1)) {
+			r->tokens = owlog_burst;
+			r->refill = monotonic_ns();
+			owlog_self = r;
+			pthread_setspecific(owlog_key, r);
+			return r;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a record to the ring of the calling thread. Use the owlog()
+ * macro rather than calling this directly.
+ */
+void
+owlog_write(int level, const char *fmt, int64_t a, int64_t b, int64_t c, int64_t d)
+{
+	struct owlog_ring *r = owlog_self;
+	owlog_record_t *rec;
+	uint64_t now = monotonic_ns();
+
+	if (r == NULL && (r = owlog_claim()) == NULL) {
+		__sync_fetch_and_add(&owlog_unowned, 1);
+		return;
+	}
+	if (owlog_rate > 0) {
+		r->tokens += (now - r->refill) / 1e9 * owlog_rate;
+		r->refill = now;
+		if (r->tokens > owlog_burst) {
+			r->tokens = owlog_burst;
+		}
+		if (r->tokens < 1) {
+			r->dropped++;
+			return;
+		}
+		r->tokens -= 1;
+	}
+	if (r->head - r->tail >= OWLOG_RING) {
+		r->dropped++;
+		return;
+	}
+	rec = &r->rec[r->head % OWLOG_RING];
+	rec->time = now;
+	rec->fmt = fmt;
+	rec->args[0] = a;
+	rec->args[1] = b;
+	rec->args[2] = c;
+	rec->args[3] = d;
+	rec->level = level;
+	/* The record must be complete before the log thread sees it */
+	__sync_synchronize();
+	r->head++;
+}
+
+static void
+owlog_flush(char *buf, int len)
+{
+	int off = 0;
+	int n;
+
+	while (off < len) {
+		n = write(owlog_fd, buf + off, len - off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		off += n;
+	}
+}
+
+/*
+ * Format a record, passing each argument as the type its conversion
+ * expects: a pointer for %s, long long with ll, long with l, else int.
+ *
+ * Returns: length of the text, at most size - 1
+ */
+static int
+owlog_printf(char *p, int size, const char *fmt, const int64_t *args)
+{
+	char spec[16];
+	int64_t arg;
+	int len = 0;
+	int i = 0;
+	int n, k;
+
+	while (*fmt && len < size - 1) {
+		if (*fmt != '%' || fmt[1] == '%') {
+			p[len++] = *fmt;
+			fmt += *fmt == '%' ? 2 : 1;
+			continue;
+		}
+		/* Copy the conversion specification up to its conversion */
+		spec[0] = '%';
+		for (k = 1; fmt[k] && !strchr("diouxXcs", fmt[k]) && k < sizeof(spec) - 2; k++) {
+			spec[k] = fmt[k];
+		}
+		if (!fmt[k]) {
+			break;
+		}
+		spec[k] = fmt[k];
+		spec[k + 1] = '\0';
+		fmt += k + 1;
+		arg = i < OWLOG_MAX_ARGS ? args[i++] : 0;
+		if (spec[k] == 's') {
+			n = snprintf(p + len, size - len, spec, (const char *)(intptr_t)arg);
+		} else if (strstr(spec, "ll")) {
+			n = snprintf(p + len, size - len, spec, (long long)arg);
+		} else if (strchr(spec, 'l')) {
+			n = snprintf(p + len, size - len, spec, (long)arg);
+		} else {
+			n = snprintf(p + len, size - len, spec, (int)arg);
+		}
+		if (n > 0) {
+			len += n < size - len ? n : size - len - 1;
+		}
+	}
+	p[len] = '\0';
+	return len;
+}
+
+/* Format a line with the wall clock time and the level */
+static int
+owlog_format(char *p, int size, uint64_t mono, int level, const char *fmt,
+	     const int64_t *args)
+{
+	uint64_t wall = mono + owlog_clock_offset;
+	int n, m;
+
+	n = snprintf(p, size, "%llu.%06llu %s ",
+		     (unsigned long long)(wall / 1000000000),
+		     (unsigned long long)(wall % 1000000000 / 1000),
+		     owlog_names[level < 0 ? 0 : level > OWLOG_DEBUG ? OWLOG_DEBUG : level]);
+	m = owlog_printf(p + n, size - n - 1, fmt, args);
+	p[n + m] = '\n';
+	return n + m + 1;
+}
+
+static char owlog_buf[OWLOG_BUFSIZE];
+static int owlog_len;
+
+/* Format a record into the buffer, writing it out first if full */
+static void
+owlog_append(uint64_t mono, int level, const char *fmt, const int64_t *args)
+{
+	if (owlog_len + OWLOG_LINE > sizeof(owlog_buf)) {
+		owlog_flush(owlog_buf, owlog_len);
+		owlog_len = 0;
+	}
+	owlog_len += owlog_format(owlog_buf + owlog_len, OWLOG_LINE, mono, level, fmt, args);
+}
+
+static void
+owlog_report_drops(unsigned long n, const char *fmt)
+{
+	int64_t args[OWLOG_MAX_ARGS] = { 0 };
+
+	args[0] = n;
+	owlog_append(monotonic_ns(), OWLOG_WARN, fmt, args);
+}
+
+/* Format and write out all records in the rings */
+static void
+owlog_drain(void)
+{
+	static unsigned long unowned_reported;
+	struct owlog_ring *r;
+	owlog_record_t *rec;
+	unsigned long dropped;
+	int released;
+	int i;
+
+	for (i = 0; i < OWLOG_THREADS; i++) {
+		r = &owlog_rings[i];
+		if (!r->used) {
+			continue;
+		}
+		/* A ring released before draining has no more records coming */
+		released = r->released;
+		__sync_synchronize();
+		while (r->tail != r->head) {
+			rec = &r->rec[r->tail % OWLOG_RING];
+			owlog_append(rec->time, rec->level, rec->fmt, rec->args);
+			__sync_synchronize();
+			r->tail++;
+		}
+		dropped = r->dropped;
+		if (dropped != r->reported) {
+			owlog_report_drops(dropped - r->reported, "log: %lu records dropped");
+			r->reported = dropped;
+		}
+		if (released) {
+			owlog_released_drops += r->dropped;
+			r->released = 0;
+			r->head = r->tail = 0;
+			r->dropped = r->reported = 0;
+			__sync_synchronize();
+			r->used = 0;
+		}
+	}
+	if (owlog_unowned != unowned_reported) {
+		dropped = owlog_unowned;
+		owlog_report_drops(dropped - unowned_reported,
+				   "log: %lu records dropped, too many threads");
+		unowned_reported = dropped;
+	}
+	owlog_flush(owlog_buf, owlog_len);
+	owlog_len = 0;
+}
+
+static void *
+owlog_run(void *arg)
+{
+	struct timespec ts = { 0, OWLOG_FLUSH_MS * 1000000 };
+
+	while (!owlog_stopping) {
+		owlog_drain();
+		nanosleep(&ts, NULL);
+	}
+	owlog_drain();
+	return NULL;
+}
+
+/*
+ * Start the background thread writing to fd and enable logging.
+ *
+ * @param fd File descriptor to write the formatted records to
+ * @param level Highest level to record
+ *
+ * Returns: 0 on success, an errno value if the thread could not be
+ * created
+ */
+int
+owlog_start(int fd, int level)
+{
+	struct timespec ts;
+	int r;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	owlog_clock_offset = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - monotonic_ns();
+	owlog_fd = fd;
+	owlog_stopping = 0;
+	if ((r = pthread_create(&owlog_thread, NULL, owlog_run, NULL)) != 0) {
+		return r;
+	}
+	owlog_started = 1;
+	owlog_level = level;
+	return 0;
+}
+
+/* Disable logging and write out what has been recorded */
+void
+owlog_stop(void)
+{
+	owlog_level = OWLOG_OFF;
+	if (!owlog_started) {
+		return;
+	}
+	owlog_stopping = 1;
+	pthread_join(owlog_thread, NULL);
+	owlog_started = 0;
+}
+
+/* Change the level at run time, e.g. to OWLOG_DEBUG during an incident */
+void
+owlog_set_level(int level)
+{
+	owlog_level = level;
+}
+
+/*
+ * @param rate Records per second per thread, 0 for no limit
+ * @param burst Records a thread can log at once after being quiet
+ */
+void
+owlog_set_rate(int rate, int burst)
+{
+	owlog_rate = rate;
+	owlog_burst = burst;
+}
+
+/* Records dropped so far */
+unsigned long
+owlog_dropped(void)
+{
+	unsigned long n = owlog_unowned + owlog_released_drops;
+	int i;
+
+	for (i = 0; i < OWLOG_THREADS; i++) {
+		n += owlog_rings[i].dropped;
+	}
+	return n;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/*
+ * Asynchronous logging
+ *
+ * owlog() checks the level and copies the format and its arguments
+ * into a fixed size record in a ring owned by the calling thread. A
+ * background thread formats the records and writes them out, so the
+ * thread logging neither formats, blocks on I/O nor allocates, and
+ * debug logging can be enabled without changing the bus timing.
+ *
+ * The format is stored as a pointer and must be a string literal. At
+ * most OWLOG_MAX_ARGS arguments are kept, each in 64 bits, so only
+ * integers and strings that do not change until the record is written
+ * out, such as literals, can be passed. Integers must be formatted
+ * with the l modifier, e.g. %ld or %lx, or with ll for 64 bit values
+ * such as ROM keys, e.g. %016llx. Records are dropped, and counted,
+ * when a ring is full or a thread logs faster than the rate limit.
+ *
+ * With OWUSB_NO_STDIO logging compiles to nothing.
+ */
+
+#ifndef OWLOG_THREADS
+#define OWLOG_THREADS 8        /* Threads logging at the same time */
+#endif
+#ifndef OWLOG_RING
+#define OWLOG_RING 256         /* Records per thread, a power of two */
+#endif
+#define OWLOG_MAX_ARGS 4
+
+/* How often the background thread writes the records out */
+#define OWLOG_FLUSH_MS 50
+
+/* Default records per second and burst of each thread */
+#define OWLOG_RATE 1000
+#define OWLOG_BURST 100
+
+enum {
+	OWLOG_OFF = -1,
+	OWLOG_ERR = 0,
+	OWLOG_WARN,
+	OWLOG_INFO,
+	OWLOG_DEBUG
+};
+
+typedef struct owlog_record {
+	uint64_t time;         /* Monotonic ns */
+	const char *fmt;
+	int64_t args[OWLOG_MAX_ARGS];
+	int level;
+} owlog_record_t;
+
+/* Highest level recorded, OWLOG_OFF until owlog_start() */
+extern volatile int owlog_level;
+
+#ifdef OWUSB_NO_STDIO
+#define owlog(level, ...) do { } while (0)
+#else
+/* Pointers go through intptr_t, so they convert without a warning */
+#define OWLOG_ARG(a) ((int64_t)__builtin_choose_expr( \
+	__builtin_classify_type(a) == 5, (intptr_t)(a), (a)))
+#define OWLOG_ARGS(fmt, a, b, c, d, ...) \
+	fmt, OWLOG_ARG(a), OWLOG_ARG(b), OWLOG_ARG(c), OWLOG_ARG(d)
+#define owlog(level, ...) do { \
+	if ((level) <= owlog_level) \
+		owlog_write(level, OWLOG_ARGS(__VA_ARGS__, 0, 0, 0, 0, 0)); \
+} while (0)
+#endif
+
+void owlog_write(int level, const char *fmt, int64_t a, int64_t b, int64_t c, int64_t d);
+int  owlog_start(int fd, int level);
+void owlog_stop(void);
+void owlog_set_level(int level);
+void owlog_set_rate(int rate, int burst);
+unsigned long owlog_dropped(void);
+
+#endif
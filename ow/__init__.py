@@ -2,7 +2,7 @@
 
 #from ow.usb import OwUsb
 #__all__ = ['usb']
-from owusb import OwUsb
+from owusb import OwUsb, adapters, format_rom, parse_rom, rom_key
 
 import sys
 import types
@@ -32,8 +32,40 @@ class OwBus(OwUsb):
 		for a in self.searchiter(cmd):
 			# create instance based on device familiy code
 			c =  family.get(ord(a[0]), OwDevice)
-			devices.append(c(self, a, selected=True))
+			# thermometers are initialized in one batch below
+			devices.append(c(self, a, selected=not issubclass(c, OwThermometer)))
+		self.snapshot_thermometers(devices)
 		return devices
+
+	def get_chain(self):
+		"""
+		Discover DS28EA00 devices using chain mode. The devices are
+		returned in their physical order along the string, and
+		each has its position set accordingly.
+		"""
+		devices = []
+		for i, a in enumerate(self.chain_search()):
+			c =  family.get(ord(a[0]), OwDevice)
+			d = c(self, a, selected=not issubclass(c, OwThermometer))
+			d.position = i
+			devices.append(d)
+		self.snapshot_thermometers(devices)
+		return devices
+
+	def snapshot_thermometers(self, devices, recall=False):
+		"""
+		Read the configuration of all thermometers among devices
+		in one batched call. With recall the EEPROM is first
+		loaded into the scratchpads with a broadcast Recall E2.
+		"""
+		therms = [d for d in devices if isinstance(d, OwThermometer)]
+		if not therms:
+			return
+		r = self.read_scratchpads([d._address for d in therms], recall)
+		for d, s in zip(therms, r):
+			if s is not None:
+				d._decode_scratchpad(s)
+				d._eeprom = d._config()
       
 	def skip_rom(self):
 		self.block_io(SKIP_ROM, reset=True)
@@ -43,9 +75,66 @@ class OwBus(OwUsb):
 		Send a Skip ROM command followed by a Convert T command
 		"""
 		self.block_io(SKIP_ROM + CONVERT_T, reset=True)
+
+	def configure_thermometers(self, temphigh, templow, res, devices=None, copy=False):
+		"""
+		Set TH, TL and resolution of all thermometers on the bus
+		with a single Skip ROM write. Note that Skip ROM addresses
+		every device on the bus, so this is meant for buses holding
+		DS18B20 compatible thermometers.
+
+		If devices are given they are verified and any mismatching
+		device is rewritten individually. With copy the scratchpads
+		are copied to EEPROM using a single strong pullup.
+
+		Returns the devices that could not be configured.
+		"""
+		self.therm_write(temphigh, templow, res)
+		failed = []
+		if devices:
+			bad = self.therm_verify([d._address for d in devices], temphigh, templow, res)
+			failed = [d for d in devices if d._address in bad]
+		if copy:
+			self.therm_copy()
+		for d in devices or []:
+			if d not in failed:
+				d._temphigh, d._templow, d._resolution = temphigh, templow, res
+				if copy:
+					d._eeprom = d._config()
+		return failed
+
+	def recall_eeprom(self):
+		"""Recall the EEPROM of all thermometers using Skip ROM"""
+		self.therm_recall()
+
+	def sample_counters(self, counters):
+		"""
+		Read the counter pages of a list of OwCounter devices in
+		one call and update their counts and rates
+		"""
+		r = self.read_counters([c._address for c in counters])
+		for c, v in zip(counters, r):
+			c._update(v)
+
+	def aggregates(self, completed=True):
+		"""
+		Return the aggregates kept by the acquisition engine as a
+		dict from address to a dict with start, count, min, max,
+		mean and last. Each of the latter is a tuple of values, the
+		temperature for thermometers and the counts and rates of
+		both channels for counters. Set the window with acq_window()
+		and run the engine with acq_cycle().
+		"""
+		r = {}
+		for a in self.acq_aggregates(completed):
+			if a is None:
+				continue
+			r[a[0]] = dict(zip(('start', 'count', 'min', 'max', 'mean', 'last'), a[1:]))
+		return r
  
 class OwDevice(object):
 	family = 0
+	position = None
 	def __init__(self, bus, address, selected=False):
 		self.bus = bus
 		self._address = address
@@ -60,15 +149,23 @@ class OwDevice(object):
 		msg = MATCH_ROM + self._address + cmd
 		return self.io(msg, reset=True, *l, **kw)
 
+	def read(self, cmd, len):
+		"""
+		Sends a command to this device and reads len bytes using a
+		single READ STRAIGHT transfer
+		"""
+		return self.bus.read_straight(MATCH_ROM + self._address + cmd, len)
+
 	def match(self):
 		msg = MATCH_ROM + self._address
 		self.io(msg, reset=True)
 
 	def address(self):
-		rev = lambda s:reduce(lambda a,b:b+a,s,'')	
-		fam = "%02x" % ord(self._address[0])
-		csum = "%02x" % ord(self._address[7])
-		return "%s.%s.%s" % (csum, "".join(map(lambda x: "%02x" % ord(x), rev(self._address[1:7]))), fam)
+		return format_rom(self._address)
+
+	def key(self):
+		"""The address as a 64 bit integer, see parse_rom()"""
+		return rom_key(self._address)
 
 	def __repr__(self):
 		return "<%s %s>" % (self.__class__.__name__, self.address())
@@ -97,11 +194,17 @@ class OwThermometer(OwDevice):
 		self._temphigh = None
 		self._resolution = 0xffff
 		self._power = None
+		# configuration last copied to or recalled from EEPROM
+		self._eeprom = None
 		OwDevice.__init__(self, *l, **kw)
 
 	def initstate(self):
 		s = self.io("\xbe", 9)
 		self._decode_scratchpad(s)
+		self._eeprom = self._config()
+
+	def _config(self):
+		return (self._temphigh, self._templow, self._resolution)
 		
 	def b2temp(self, t):
 		return (struct.unpack("h", t)[0] & (self._resolution | 0xfffc)) * 0.0625
@@ -129,8 +232,12 @@ class OwThermometer(OwDevice):
 			templow = self._templow
 		if res is None:
 			res = self._resolution
+		if (temphigh, templow, res) == self._config():
+			# nothing changed, skip the bus transfer
+			return
 		cmd = struct.pack("BbbB", 0x4e, temphigh, templow, self.res2b(res))
 		self.cmd(cmd)
+		self._temphigh, self._templow, self._resolution = temphigh, templow, res
 
 	def _decode_scratchpad(self, s):
 		self._resolution = self.b2res(s[4])
@@ -141,7 +248,7 @@ class OwThermometer(OwDevice):
 
 	def read_scratchpad(self): 
 		# FIX: check CRC or raise exception
-		s = self.cmd(READ_SCRATCHPAD, 9)
+		s = self.read(READ_SCRATCHPAD, 9)
 		return self._decode_scratchpad(s)
 
 	def temp(self, convert=True):
@@ -152,24 +259,67 @@ class OwThermometer(OwDevice):
 		return self.read_scratchpad()[0]
 	
 	def copy_scratchpad(self):
+		"""Copy to EEPROM, unless it already holds the configuration"""
+		if self._eeprom == self._config():
+			return
 		self.cmd(COPY_SCRATCHPAD)
+		self._eeprom = self._config()
 
 	def recall_eeprom(self):
 		self.cmd(RECALL_EEPROM)
+		if self._eeprom is not None:
+			self._temphigh, self._templow, self._resolution = self._eeprom
 
 	def read_power_supply(self):
 		return self.cmd(READ_POWER_SUPPLY)
 
+class OwChainThermometer(OwThermometer):
+	family = 0x42
+	# DS28EA00
+
 class OwCounter(OwDevice):
 	family = 0x1d
 
+	def __init__(self, *l, **kw):
+		self._count = [None, None]
+		self._time = [None, None]
+		self._rate = [None, None]
+		self.errors = 0
+		OwDevice.__init__(self, *l, **kw)
+
+	def _update(self, values):
+		if values is None:
+			self.errors += 1
+			return
+		for i, v in enumerate(values):
+			if v is None:
+				continue
+			count, t = v
+			if self._count[i] is not None and t > self._time[i]:
+				# the counters are 32 bits and wrap around
+				delta = (count - self._count[i]) & 0xffffffff
+				self._rate[i] = delta / (t - self._time[i])
+			self._count[i] = count
+			self._time[i] = t
+
+	def sample(self):
+		"""Read counters A and B and update the rates"""
+		self._update(self.bus.read_counters([self._address])[0])
+
+	def counts(self):
+		return tuple(self._count)
+
+	def rates(self):
+		"""Counts per second of counters A and B"""
+		return tuple(self._rate)
+
 	def read_memory(self, address, len):
 		cmd = READ_MEMORY + struct.pack("<H", address)
-		return self.cmd(cmd, len)
+		return self.read(cmd, len)
 	
 	def read_memory_and_counter(self, address=0x01c0, len=42):
 		cmd = READ_MEMORY_AND_COUNTER + struct.pack("<H", address)
-		return self.cmd(cmd, len)
+		return self.read(cmd, len)
 
 class OwAddressableSwitch(OwDevice):
 	family = 0x05
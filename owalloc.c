@@ -0,0 +1,500 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Allocation check and memory soak of the poll path
+ *
+ * owalloc [cycles]
+ *   Run cycles acquisition cycles (default 1000) on a time grid and
+ *   fail if any of them allocated from the heap. The first cycle is
+ *   run before counting starts.
+ *
+ * owalloc -s [days]
+ *   Run a simulated week, or days, of cycles at a 1 s period as fast
+ *   as possible and print the resident set size after every simulated
+ *   day. Fails if it grew.
+ *
+ * Both run against a simulated adapter with thermometers and counters
+ * on the bus, so no hardware is needed. The simulation replaces the
+ * four libusb transfer functions the poll path uses, and the sleeps
+ * for the time on the wire are skipped. Every 101st scratchpad is
+ * corrupted so the retry path is exercised too. malloc() and friends
+ * are interposed to count the calls.
+ *
+ * The monotonic and wall clocks are simulated as well, and advance by
+ * the period each cycle, so aggregation windows close, heartbeats are
+ * due and the slow lane is read as in real time. Some thermometers
+ * have a deadband wider than the simulated temperatures and are only
+ * published on the heartbeat, and one stops answering now and then,
+ * so it is moved to the slow lane and back. The check runs these at a
+ * 10 ms scale to fit its 1 ms period, the soak at 60 s.
+ */
+
+#include "ds2490.h"
+#include "ds18b20.h"
+#include "grid.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <usb.h>
+#include <sys/syscall.h>
+
+/* Request types of the adapter, as in ds2490.c */
+#define SIM_CONTROL_CMD 0x00
+#define SIM_COMM_CMD 0x01
+#define SIM_COM_BIT_IO 0x20
+#define SIM_COM_BLOCK_IO 0x70
+#define SIM_COM_READ_STRAIGHT 0x80
+
+/* Function commands of the simulated devices */
+#define SIM_READ_SCRATCHPAD 0xbe
+#define SIM_READ_MEMORY_COUNTER 0xa5
+
+#define SIM_THERMOMETERS 8
+#define SIM_COUNTERS 2
+#define SIM_CORRUPT_EVERY 101
+
+/* Thermometers 0 to SIM_QUIET - 1 only publish on the heartbeat */
+#define SIM_QUIET 4
+#define SIM_QUIET_DEADBAND 10.0
+
+/* Thermometer failing for one time unit out of SIM_FLAKY_EVERY */
+#define SIM_FLAKY (SIM_THERMOMETERS - 1)
+#define SIM_FLAKY_EVERY 30
+
+/* Start of the simulated clocks */
+#define SIM_MONOTONIC_START 1000000000000ULL
+#define SIM_EPOCH 1700000000000000000ULL
+
+#define SECONDS_PER_DAY (24 * 3600)
+
+/*
+ * Heap accounting
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile int armed;
+static unsigned long allocs;
+static unsigned long frees;
+
+void *
+malloc(size_t size)
+{
+	if (armed) allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (armed) allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (armed) allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	if (armed && ptr) frees++;
+	__libc_free(ptr);
+}
+
+/*
+ * Simulated adapter. Data written on EP2 is queued until a command
+ * consumes it, and the data the command reads from the bus is queued
+ * for EP3.
+ */
+
+static uint8_t sim_roms[SIM_THERMOMETERS + SIM_COUNTERS][8];
+static uint8_t sim_out[4 * DS2490_FIFOSIZE];
+static int sim_outlen;
+static uint8_t sim_in[4 * DS2490_FIFOSIZE];
+static int sim_inlen;
+static unsigned long sim_reads;
+static uint32_t sim_count;
+
+/*
+ * Simulated time
+ */
+
+static uint64_t sim_now = SIM_MONOTONIC_START;
+static uint64_t sim_unit;
+
+int
+clock_gettime(clockid_t id, struct timespec *ts)
+{
+	uint64_t t;
+
+	switch (id) {
+	case CLOCK_MONOTONIC: t = sim_now; break;
+	case CLOCK_REALTIME: t = SIM_EPOCH + sim_now - SIM_MONOTONIC_START; break;
+	default: return syscall(SYS_clock_gettime, id, ts);
+	}
+	ts->tv_sec = t / 1000000000;
+	ts->tv_nsec = t % 1000000000;
+	return 0;
+}
+
+/* Sleeping on the grid jumps to the slot */
+int
+clock_nanosleep(clockid_t id, int flags, const struct timespec *req,
+		struct timespec *rem)
+{
+	uint64_t t = (uint64_t)req->tv_sec * 1000000000 + req->tv_nsec;
+
+	if (!(flags & TIMER_ABSTIME)) {
+		t += sim_now;
+	} else if (id == CLOCK_REALTIME) {
+		t -= SIM_EPOCH - SIM_MONOTONIC_START;
+	}
+	if (t > sim_now) {
+		sim_now = t;
+	}
+	return 0;
+}
+
+/* Real time in ns, for reporting how long the run took */
+static uint64_t
+real_ns(void)
+{
+	struct timespec ts;
+
+	syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sim_init(void)
+{
+	int i;
+
+	for (i = 0; i < SIM_THERMOMETERS + SIM_COUNTERS; i++) {
+		sim_roms[i][0] = i < SIM_THERMOMETERS ? DS18B20_FAMILY : DS2423_FAMILY;
+		sim_roms[i][1] = i + 1;
+		sim_roms[i][7] = calc_crc8(sim_roms[i], 7);
+	}
+}
+
+static void
+sim_queue(const uint8_t *data, int len)
+{
+	if (sim_inlen + len > sizeof(sim_in)) {
+		len = sizeof(sim_in) - sim_inlen;
+	}
+	memcpy(sim_in + sim_inlen, data, len);
+	sim_inlen += len;
+}
+
+static void
+sim_consume(int len)
+{
+	if (len > sim_outlen) {
+		len = sim_outlen;
+	}
+	memmove(sim_out, sim_out + len, sim_outlen - len);
+	sim_outlen -= len;
+}
+
+static int
+sim_find(const uint8_t *rom)
+{
+	int i;
+
+	for (i = 0; i < SIM_THERMOMETERS + SIM_COUNTERS; i++) {
+		if (memcmp(sim_roms[i], rom, 8) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Answer a Match ROM command of wlen bytes with rlen bytes */
+static void
+sim_read_straight(int wlen, int rlen)
+{
+	uint8_t buf[DS2490_FIFOSIZE];
+	uint16_t crc;
+	int temp;
+	int i;
+
+	memset(buf, 0xff, sizeof(buf));
+	i = wlen >= 10 && sim_outlen >= wlen ? sim_find(&sim_out[1]) : -1;
+	if (i == SIM_FLAKY && sim_now / sim_unit % SIM_FLAKY_EVERY == 0) {
+		/* Not answering */
+		i = -1;
+	}
+	if (i >= 0 && sim_out[9] == SIM_READ_SCRATCHPAD) {
+		/* 20 - 24 C in steps of 1/16 */
+		temp = 20 * 16 + (sim_reads * 7 + i) % 64;
+		buf[0] = temp & 0xff;
+		buf[1] = temp >> 8;
+		buf[2] = 0x4b;
+		buf[3] = 0x46;
+		buf[4] = 0x7f;
+		buf[5] = 0xff;
+		buf[6] = 0x0c;
+		buf[7] = 0x10;
+		buf[8] = calc_crc8(buf, 8);
+		if (++sim_reads % SIM_CORRUPT_EVERY == 0) {
+			buf[8] ^= 0x01;
+		}
+	} else if (i >= 0 && sim_out[9] == SIM_READ_MEMORY_COUNTER && wlen == 12) {
+		/* Last byte of the page, counter, zeros and inverted CRC16 */
+		sim_count += 3;
+		memcpy(buf, &sim_out[9], 3);
+		buf[3] = 0;
+		buf[4] = sim_count & 0xff;
+		buf[5] = sim_count >> 8;
+		buf[6] = sim_count >> 16;
+		buf[7] = sim_count >> 24;
+		memset(&buf[8], 0, 4);
+		crc = ~calc_crc16(buf, 12);
+		memmove(buf, &buf[3], 9);
+		buf[9] = crc & 0xff;
+		buf[10] = crc >> 8;
+	}
+	sim_consume(wlen);
+	sim_queue(buf, rlen < sizeof(buf) ? rlen : sizeof(buf));
+}
+
+int
+usb_control_msg(usb_dev_handle *h, int type, int request, int value,
+		int index, char *bytes, int size, int timeout)
+{
+	uint8_t one = 1;
+
+	if (request == SIM_CONTROL_CMD && value != 0x0002) {
+		/* Everything but resume flushes or halts, drop the FIFOs */
+		sim_outlen = sim_inlen = 0;
+		return 0;
+	}
+	if (request != SIM_COMM_CMD) {
+		return 0;
+	}
+	switch (value & 0xf0) {
+	case SIM_COM_READ_STRAIGHT:
+		sim_read_straight(value >> 8 & 0xff, index);
+		break;
+	case SIM_COM_BLOCK_IO:
+		/* Everything written is seen on the wire */
+		if (index > sim_outlen) {
+			index = sim_outlen;
+		}
+		sim_queue(sim_out, index);
+		sim_consume(index);
+		break;
+	case SIM_COM_BIT_IO:
+		/* Conversions are always done */
+		sim_queue(&one, 1);
+		break;
+	}
+	return 0;
+}
+
+int
+usb_bulk_write(usb_dev_handle *h, int ep, char *bytes, int size, int timeout)
+{
+	if (sim_outlen + size > sizeof(sim_out)) {
+		return -1;
+	}
+	memcpy(sim_out + sim_outlen, bytes, size);
+	sim_outlen += size;
+	return size;
+}
+
+int
+usb_bulk_read(usb_dev_handle *h, int ep, char *bytes, int size, int timeout)
+{
+	int n = size < sim_inlen ? size : sim_inlen;
+
+	memcpy(bytes, sim_in, n);
+	memmove(sim_in, sim_in + n, sim_inlen - n);
+	sim_inlen -= n;
+	return n;
+}
+
+/* Always idle, with the fill level of the receive FIFO */
+int
+usb_interrupt_read(usb_dev_handle *h, int ep, char *bytes, int size, int timeout)
+{
+	memset(bytes, 0, 16);
+	bytes[STATE_STATUS_FLAGS] = STATE_IDLE;
+	bytes[STATE_DATA_IN_BUFFER_STATUS] = sim_inlen < 0xff ? sim_inlen : 0xff;
+	return 16;
+}
+
+/* No time passes on a simulated bus */
+int
+usleep(useconds_t usec)
+{
+	return 0;
+}
+
+static owusb_device_t sim_dev;
+static unsigned long published;
+static unsigned long heartbeats;
+static unsigned long windows;
+static unsigned long slow_reads;
+static uint64_t last_window[SIM_THERMOMETERS + SIM_COUNTERS];
+static unsigned long last_reads;
+
+static void
+count_publish(owacq_t *a, owacq_dev_t *d, void *arg)
+{
+	published++;
+	if (d - a->devs < SIM_QUIET && d->emitted > 1) {
+		heartbeats++;
+	}
+}
+
+/* Count the windows completed and the reads in the slow lane */
+static void
+tally(owacq_t *a)
+{
+	owacq_dev_t *d = &a->devs[SIM_FLAKY];
+	int i;
+
+	for (i = 0; i < a->ndevs; i++) {
+		if (a->devs[i].completed.start != last_window[i]) {
+			last_window[i] = a->devs[i].completed.start;
+			windows++;
+		}
+	}
+	if (d->slow && d->reads != last_reads) {
+		slow_reads++;
+	}
+	last_reads = d->reads;
+}
+
+/*
+ * Set up the engine with the window, heartbeat and slow lane interval,
+ * and the failures of the flaky thermometer, all at unit ns
+ */
+static void
+setup(owacq_t *a, uint64_t unit)
+{
+	int i;
+
+	sim_init();
+	sim_unit = unit;
+	sim_dev.handle = (usb_dev_handle *)&sim_dev;
+	sim_dev.timeout = 1000;
+	owacq_init(a, &sim_dev);
+	a->publish = count_publish;
+	a->window = unit;
+	a->slow_interval = unit;
+	for (i = 0; i < SIM_THERMOMETERS + SIM_COUNTERS; i++) {
+		owacq_add(a, sim_roms[i]);
+		owacq_set_deadband(a, i, i < SIM_QUIET ? SIM_QUIET_DEADBAND : 0.1, unit);
+	}
+}
+
+/* Resident set size in kB */
+static long
+rss_kb(void)
+{
+	FILE *f;
+	long pages = 0, resident = 0;
+
+	if ((f = fopen("/proc/self/statm", "r")) == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+		resident = -1;
+	}
+	fclose(f);
+	return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int
+check(int cycles)
+{
+	static owacq_t acq;
+	static owgrid_t grid;
+	int i;
+
+	setup(&acq, 10000000);
+	owgrid_init(&grid, 1000000);
+	owgrid_add(&grid, &acq);
+	owgrid_step(&grid);
+
+	armed = 1;
+	for (i = 0; i < cycles; i++) {
+		owgrid_step(&grid);
+		tally(&acq);
+	}
+	armed = 0;
+
+	printf("%d cycles, %lu published, %lu retries, %llu overruns\n",
+	       cycles, published, acq.retries, (unsigned long long)grid.stats.overruns);
+	printf("%lu windows, %lu heartbeats, %lu quarantines, %lu slow lane reads\n",
+	       windows, heartbeats, acq.devs[SIM_FLAKY].quarantines, slow_reads);
+	printf("%lu allocations, %lu frees\n", allocs, frees);
+	return allocs || frees ? 1 : 0;
+}
+
+static int
+soak(int days)
+{
+	static owacq_t acq;
+	long first = 0, rss = 0;
+	uint64_t t = real_ns();
+	int day, s;
+
+	setup(&acq, 60 * 1000000000ULL);
+	owacq_cycle(&acq);
+	/*
+	 * Day 1 is the baseline: the first day faults in the code and data
+	 * the short warm up did not touch, and the day 0 report sets up
+	 * the stdio buffers.
+	 */
+	for (day = 0; day <= days; day++) {
+		armed = 1;
+		for (s = 0; day > 0 && s < SECONDS_PER_DAY; s++) {
+			sim_now += 1000000000;
+			owacq_cycle(&acq);
+			tally(&acq);
+		}
+		armed = 0;
+		rss = rss_kb();
+		if (day == 1) {
+			first = rss;
+		}
+		printf("day %d: rss %ld kB, %lu published, %lu retries, %lu allocations, %.1f s\n",
+		       day, rss, published, acq.retries, allocs, (real_ns() - t) / 1e9);
+		printf("       %lu windows, %lu heartbeats, %lu quarantines, %lu slow lane reads\n",
+		       windows, heartbeats, acq.devs[SIM_FLAKY].quarantines, slow_reads);
+		fflush(stdout);
+	}
+	if (rss > first || allocs) {
+		printf("memory grew: %ld kB, %lu allocations\n", rss - first, allocs);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+		return soak(argc > 2 ? atoi(argv[2]) : 7);
+	}
+	if (argc > 1 && argv[1][0] == '-') {
+		fprintf(stderr, "usage: %s [cycles]\n"
+			"       %s -s [days]\n", argv[0], argv[0]);
+		return 1;
+	}
+	return check(argc > 1 ? atoi(argv[1]) : 1000);
+}
@@ -0,0 +1,323 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Benchmarks, run against real adapters. The read benchmark uses
+ * the first adapter only.
+ *
+ * owbench read [count]
+ *   Read all thermometer scratchpads count times, first with block
+ *   I/O and then with READ STRAIGHT, and compare the bytes moved over
+ *   EP2/EP3 and the host CPU time used. Then read them in batches and
+ *   report how long after the start of a batch the results arrive.
+ *
+ * owbench cancel [delay_ms]
+ *   Start reading all thermometers in batches on a separate thread,
+ *   cancel it after delay_ms and report how long the cancellation took
+ *   and how long until the reading thread had returned.
+ *
+ * owbench grid [-p priority] [-c cpu] [-l] [-H hogs] [period_ms] [cycles]
+ *   Sample all adapters on a fixed time grid and report how far from
+ *   the grid slots the conversions were started. The acquisition
+ *   thread can be run with SCHED_FIFO priority, pinned to a CPU and
+ *   with memory locked. Background threads spinning on the same CPU
+ *   can be added to measure the jitter under load.
+ */
+
+#define _GNU_SOURCE
+
+#include "ds2490.h"
+#include "ds18b20.h"
+#include "grid.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MAX_DEVS 64
+
+static uint8_t owdevs[MAX_DEVS][8];
+static int devcount;
+
+static uint64_t
+cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int
+read_block_io(owusb_device_t *dev, const uint8_t *addr, uint8_t *sp)
+{
+	uint8_t cmd[10];
+
+	cmd[0] = WIRE_CMD_MATCH_ROM;
+	memcpy(&cmd[1], addr, 8);
+	cmd[9] = 0xbe;
+	if (owusb_block_io(dev, cmd, 10, sp, DS18B20_SCRATCHPAD_LEN, 1, 0) != 0) {
+		return OWUSB_EIO;
+	}
+	return calc_crc8(sp, DS18B20_SCRATCHPAD_LEN) == 0 ? 0 : OWUSB_ECRC;
+}
+
+static void
+bench_read(owusb_device_t *dev, const char *name,
+	   int (*read)(owusb_device_t *, const uint8_t *, uint8_t *), int count)
+{
+	uint8_t sp[DS18B20_SCRATCHPAD_LEN];
+	uint64_t t, cpu;
+	int i, j;
+	int reads = 0, errors = 0;
+
+	dev->ep2_bytes = dev->ep3_bytes = 0;
+	cpu = cpu_us();
+	t = monotonic_ns();
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < devcount; j++) {
+			if (owdevs[j][0] != DS18B20_FAMILY) continue;
+			if (read(dev, owdevs[j], sp) != 0) errors++;
+			reads++;
+		}
+	}
+	t = monotonic_ns() - t;
+	cpu = cpu_us() - cpu;
+	if (reads == 0) {
+		printf("No thermometers found\n");
+		return;
+	}
+	printf("%-14s %6d reads %4d errors  EP2 %5.1f B/read  EP3 %5.1f B/read  "
+	       "CPU %6.1f us/read  wall %6.2f ms/read\n",
+	       name, reads, errors,
+	       (double)dev->ep2_bytes / reads, (double)dev->ep3_bytes / reads,
+	       (double)cpu / reads, t / 1e6 / reads);
+}
+
+static uint64_t batch_start;
+static uint64_t latency[MAX_DEVS];
+static int batch_errors;
+
+static void
+batch_ready(int i, int status, uint8_t *sp, void *arg)
+{
+	latency[i] = monotonic_ns() - batch_start;
+	if (status != 0) batch_errors++;
+}
+
+static int
+cmp_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_batch(owusb_device_t *dev, int count)
+{
+	static uint64_t median[1000];
+	uint8_t roms[MAX_DEVS][8];
+	uint64_t total = 0;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < devcount; i++) {
+		if (owdevs[i][0] == DS18B20_FAMILY) memcpy(roms[n++], owdevs[i], 8);
+	}
+	if (n == 0 || count <= 0) {
+		return;
+	}
+	if (count > 1000) count = 1000;
+	for (i = 0; i < count; i++) {
+		batch_start = monotonic_ns();
+		ds18b20_read_batch(dev, roms, n, batch_ready, NULL);
+		total += monotonic_ns() - batch_start;
+		qsort(latency, n, sizeof(latency[0]), cmp_uint64);
+		median[i] = latency[n / 2];
+	}
+	qsort(median, count, sizeof(median[0]), cmp_uint64);
+	printf("%-14s %6d reads %4d errors  batch %6.2f ms  median result latency %6.2f ms\n",
+	       "batched", n * count, batch_errors, total / 1e6 / count, median[count / 2] / 1e6);
+}
+
+static uint8_t cancel_roms[MAX_DEVS][8];
+static int cancel_n;
+static volatile int cancel_result;
+static uint64_t cancel_done;
+
+static void
+cancel_ready(int i, int status, uint8_t *sp, void *arg)
+{
+}
+
+static void *
+cancel_reader(void *arg)
+{
+	owusb_device_t *dev = arg;
+	unsigned gen = dev->cancel_gen;
+
+	while (dev->cancel_gen == gen) {
+		cancel_result = ds18b20_read_batch(dev, cancel_roms, cancel_n, cancel_ready, NULL);
+	}
+	cancel_done = monotonic_ns();
+	return NULL;
+}
+
+static void
+bench_cancel(owusb_device_t *dev, int delay_ms)
+{
+	pthread_t t;
+	uint64_t start;
+	int i;
+
+	for (i = 0; i < devcount; i++) {
+		if (owdevs[i][0] == DS18B20_FAMILY) memcpy(cancel_roms[cancel_n++], owdevs[i], 8);
+	}
+	if (cancel_n == 0) {
+		printf("No thermometers found\n");
+		return;
+	}
+	pthread_create(&t, NULL, cancel_reader, dev);
+	usleep(delay_ms * 1000);
+	start = monotonic_ns();
+	if (owusb_cancel(dev) != 0) {
+		printf("Failed to recover the adapter\n");
+	}
+	pthread_join(t, NULL);
+	printf("cancel latency %.2f ms, reader returned after %.2f ms\n",
+	       dev->cancel_latency / 1e6, (cancel_done - start) / 1e6);
+}
+
+static void
+print_grid(owgrid_t *g)
+{
+	printf("cycles %llu overruns %llu\n",
+	       (unsigned long long)g->stats.cycles,
+	       (unsigned long long)g->stats.overruns);
+	printf("offset us: mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       owgrid_mean_offset(g) / 1e3,
+	       owgrid_percentile(g, 50) / 1e3, owgrid_percentile(g, 90) / 1e3,
+	       owgrid_percentile(g, 99) / 1e3, owgrid_percentile(g, 99.9) / 1e3,
+	       g->stats.offset_max / 1e3);
+	printf("wall clock drift: %.1f us\n", g->stats.clock_drift / 1e3);
+}
+
+static volatile int hog_stop;
+
+static void *
+hog(void *arg)
+{
+	volatile unsigned long n = 0;
+
+	while (!hog_stop) {
+		n++;
+	}
+	return NULL;
+}
+
+static int
+bench_grid(int argc, char *argv[])
+{
+	static owacq_t acq[OWGRID_MAX_ACQ];
+	static owgrid_t grid;
+	pthread_t hogs[64];
+	owgrid_rt_t rt = { 0, -1, 0 };
+	cpu_set_t cpus;
+	int nhogs = 0;
+	int period_ms = 1000;
+	int i, r;
+
+	while ((i = getopt(argc, argv, "p:c:lH:")) != -1) {
+		switch (i) {
+		case 'p': rt.priority = atoi(optarg); break;
+		case 'c': rt.cpu = atoi(optarg); break;
+		case 'l': rt.lock = 1; break;
+		case 'H': nhogs = atoi(optarg); break;
+		default: return 1;
+		}
+	}
+	if (optind < argc) period_ms = atoi(argv[optind++]);
+	if (nhogs > 64) nhogs = 64;
+
+	if (period_ms <= 0 || owgrid_init(&grid, period_ms * 1000000ULL) < 0) {
+		fprintf(stderr, "Period must be a positive number of ms\n");
+		return 1;
+	}
+	grid.cycles = optind < argc ? atoi(argv[optind]) : 60;
+	for (i = 0; i < owusb_dev_count && i < OWGRID_MAX_ACQ; i++) {
+		owacq_init(&acq[i], &owusb_devs[i]);
+		owacq_discover(&acq[i]);
+		owgrid_add(&grid, &acq[i]);
+	}
+	for (i = 0; i < nhogs; i++) {
+		pthread_create(&hogs[i], NULL, hog, NULL);
+		if (rt.cpu >= 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(rt.cpu, &cpus);
+			pthread_setaffinity_np(hogs[i], sizeof(cpus), &cpus);
+		}
+	}
+	if ((r = owgrid_start(&grid, &rt)) != 0) {
+		fprintf(stderr, "Failed to start acquisition thread: %s\n", strerror(r));
+		return 1;
+	}
+	owgrid_join(&grid);
+	hog_stop = 1;
+	for (i = 0; i < nhogs; i++) {
+		pthread_join(hogs[i], NULL);
+	}
+	printf("priority %d cpu %d lock %d hogs %d\n", rt.priority, rt.cpu, rt.lock, nhogs);
+	print_grid(&grid);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	owusb_device_t *dev;
+	int count = 100;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s read [count]\n"
+			"       %s cancel [delay_ms]\n"
+			"       %s grid [-p priority] [-c cpu] [-l] [-H hogs] [period_ms] [cycles]\n",
+			argv[0], argv[0], argv[0]);
+		return 1;
+	}
+	if (argc > 2 && (strcmp(argv[1], "read") == 0 || strcmp(argv[1], "cancel") == 0)) {
+		count = atoi(argv[2]);
+	}
+	if ((i = owusb_init()) != 0) {
+		printf("Failed to initialize: %d\n", i);
+		return -1;
+	}
+	if (owusb_dev_count == 0) {
+		printf("No adapters found\n");
+		return -1;
+	}
+	dev = &owusb_devs[0];
+
+	if (strcmp(argv[1], "read") == 0) {
+		devcount = owusb_search(dev, WIRE_CMD_SEARCH_ROM, (uint8_t *)owdevs, MAX_DEVS * 8) / 8;
+		bench_read(dev, "block I/O", read_block_io, count);
+		bench_read(dev, "READ STRAIGHT", ds18b20_read_scratchpad, count);
+		bench_batch(dev, count);
+	} else if (strcmp(argv[1], "cancel") == 0) {
+		devcount = owusb_search(dev, WIRE_CMD_SEARCH_ROM, (uint8_t *)owdevs, MAX_DEVS * 8) / 8;
+		bench_cancel(dev, argc > 2 ? count : 50);
+	} else if (strcmp(argv[1], "grid") == 0) {
+		return bench_grid(argc - 1, argv + 1);
+	} else {
+		fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
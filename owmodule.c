@@ -3,6 +3,11 @@
 #include <Python.h>
 
 #include "ds2490.h"
+#include "ds2423.h"
+#include "ds28ea00.h"
+#include "ds18b20.h"
+#include "acquire.h"
+#include "util.h"
 
 
 /*********************************************
@@ -13,6 +18,7 @@
 typedef struct {
 	PyObject_HEAD
 	owusb_device_t *dev;
+	owacq_t *acq;          /* Acquisition engine, set up on first use */
 } OwUsbObject;
 
 typedef struct  {
@@ -37,18 +43,46 @@ OwUsb_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 static int
 OwUsbObject_init(OwUsbObject *self, PyObject *args, PyObject *kwds)
 {
+	static char *kwlist[] = { "devnum", "warm", NULL };
 	int devnum;
+	int warm = 0;
 
-	if (!PyArg_ParseTuple(args, "i", &devnum)) {
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|i", kwlist, &devnum, &warm)) {
 		return -1;
 	}
-	if (devnum >= owusb_dev_count) {
+	/* The adapter is opened on first use, not at import */
+	if (devnum < 0 || devnum >= owusb_enumerate()) {
+		PyErr_SetString(PyExc_IndexError, "No such adapter");
+		return -1;
+	}
+	if ((self->dev = owusb_attach(devnum, warm)) == NULL) {
+		PyErr_SetString(PyExc_IOError, "Failed to open adapter");
 		return -1;
 	}
-	self->dev = &owusb_devs[devnum];	
 	return 0;
 }
 
+static void
+OwUsbObject_dealloc(OwUsbObject *self)
+{
+	PyMem_Free(self->acq);
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static owacq_t *
+get_acq(OwUsbObject *self)
+{
+	if (self->acq == NULL) {
+		self->acq = PyMem_Malloc(sizeof(owacq_t));
+		if (self->acq == NULL) {
+			PyErr_NoMemory();
+			return NULL;
+		}
+		owacq_init(self->acq, self->dev);
+	}
+	return self->acq;
+}
+
 static PyObject *
 ow_search(OwUsbObject *self, PyObject *args)
 {
@@ -77,6 +111,31 @@ ow_search(OwUsbObject *self, PyObject *args)
 	
 }
 
+static PyObject *
+ow_chain_search(OwUsbObject *self)
+{
+	PyObject *l;
+	PyObject *s;
+	uint8_t roms[256][8];
+	int n;
+	int i;
+
+	n = ds28ea00_chain_discover(self->dev, roms, 256);
+	if (n < 0) {
+		PyErr_SetString(PyExc_IOError, "Chain discovery failed");
+		return NULL;
+	}
+	if ((l = PyList_New(0)) == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		s = PyString_FromStringAndSize((char *)roms[i], 8);
+		PyList_Append(l, s);
+		Py_DECREF(s);
+	}
+	return l;
+}
+
 static PyObject *
 ow_search_first(OwUsbObject *self, PyObject *args)
 {
@@ -159,6 +218,33 @@ ow_cmd(OwUsbObject *self, PyObject *args)
 	return Py_BuildValue("s#", outbuf, result);
 }
 
+static PyObject *
+ow_read_straight(OwUsbObject *self, PyObject *args, PyObject *kwds)
+{
+	uint8_t readbuf[128];
+	uint8_t *writebuf;
+	int writebuflen;
+	int readbuflen;
+	int reset = 1;
+	int r;
+
+	static char *kwlist[] = { "cmd", "readlen", "reset", NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#i|i", kwlist, &writebuf, &writebuflen, &readbuflen, &reset)) {
+		return NULL;
+	}
+	if (readbuflen > sizeof(readbuf) || writebuflen > 255) {
+		PyErr_SetString(PyExc_ValueError, "Command or read too long");
+		return NULL;
+	}
+	r = owusb_read_straight(self->dev, writebuf, writebuflen, readbuf, readbuflen, reset);
+	if (r < 0) {
+		PyErr_Format(PyExc_IOError, "Read failed (%d)", r);
+		return NULL;
+	}
+	return Py_BuildValue("s#", readbuf, readbuflen);
+}
+
 static PyObject *
 ow_reset(OwUsbObject *self)
 {
@@ -203,6 +289,323 @@ ow_block_io(OwUsbObject *self, PyObject *args, PyObject *kwds)
 	return Py_BuildValue("s#", readbuf, readbuflen);
 }
 
+/* (count, time) of a counter channel, or None if it was not read */
+static PyObject *
+counter_value(ds2423_t *c, int i)
+{
+	if (!c->valid[i]) {
+		Py_RETURN_NONE;
+	}
+	return Py_BuildValue("(kd)", (unsigned long)c->count[i], c->time[i] / 1e9);
+}
+
+static PyObject *
+ow_read_counters(OwUsbObject *self, PyObject *args)
+{
+	PyObject *addrs;
+	PyObject *seq;
+	PyObject *l;
+	PyObject *o;
+	PyObject *item;
+	ds2423_t c;
+	char *addr;
+	Py_ssize_t addrlen;
+	int channels = DS2423_CHANNEL_A | DS2423_CHANNEL_B;
+	int n;
+	int i;
+
+	if (!PyArg_ParseTuple(args, "O|i", &addrs, &channels)) {
+		return NULL;
+	}
+	seq = PySequence_Fast(addrs, "Addresses must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+	n = PySequence_Fast_GET_SIZE(seq);
+	if ((l = PyList_New(n)) == NULL) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		if (PyString_AsStringAndSize(item, &addr, &addrlen) < 0 || addrlen != 8) {
+			PyErr_SetString(PyExc_ValueError, "Address must be 8 bytes long");
+			Py_DECREF(l);
+			Py_DECREF(seq);
+			return NULL;
+		}
+		ds2423_init(&c, (uint8_t *)addr, channels);
+		if (ds2423_sample(self->dev, &c) < 0) {
+			Py_INCREF(Py_None);
+			PyList_SET_ITEM(l, i, Py_None);
+			continue;
+		}
+		o = Py_BuildValue("(NN)", counter_value(&c, DS2423_COUNTER_A),
+				  counter_value(&c, DS2423_COUNTER_B));
+		PyList_SET_ITEM(l, i, o);
+	}
+	Py_DECREF(seq);
+	return l;
+}
+
+/* Parse an optional address argument, None meaning broadcast */
+static int
+parse_addr(PyObject *o, const uint8_t **addr)
+{
+	char *s;
+	Py_ssize_t len;
+
+	if (o == NULL || o == Py_None) {
+		*addr = NULL;
+		return 0;
+	}
+	if (PyString_AsStringAndSize(o, &s, &len) < 0 || len != 8) {
+		PyErr_SetString(PyExc_ValueError, "Address must be 8 bytes long");
+		return -1;
+	}
+	*addr = (const uint8_t *)s;
+	return 0;
+}
+
+static PyObject *
+ow_therm_write(OwUsbObject *self, PyObject *args)
+{
+	PyObject *o = NULL;
+	const uint8_t *addr;
+	int th, tl, res;
+
+	if (!PyArg_ParseTuple(args, "iii|O", &th, &tl, &res, &o)) {
+		return NULL;
+	}
+	if (parse_addr(o, &addr) < 0) {
+		return NULL;
+	}
+	return Py_BuildValue("i", ds18b20_write_scratchpad(self->dev, addr, th, tl, res));
+}
+
+static PyObject *
+ow_therm_copy(OwUsbObject *self, PyObject *args)
+{
+	PyObject *o = NULL;
+	const uint8_t *addr;
+
+	if (!PyArg_ParseTuple(args, "|O", &o)) {
+		return NULL;
+	}
+	if (parse_addr(o, &addr) < 0) {
+		return NULL;
+	}
+	return Py_BuildValue("i", ds18b20_copy_scratchpad(self->dev, addr));
+}
+
+static PyObject *
+ow_therm_recall(OwUsbObject *self, PyObject *args)
+{
+	PyObject *o = NULL;
+	const uint8_t *addr;
+
+	if (!PyArg_ParseTuple(args, "|O", &o)) {
+		return NULL;
+	}
+	if (parse_addr(o, &addr) < 0) {
+		return NULL;
+	}
+	return Py_BuildValue("i", ds18b20_recall_e2(self->dev, addr));
+}
+
+static PyObject *
+ow_therm_verify(OwUsbObject *self, PyObject *args)
+{
+	PyObject *addrs;
+	PyObject *seq;
+	PyObject *l;
+	uint8_t (*roms)[8];
+	int *failed;
+	const uint8_t *addr;
+	int th, tl, res;
+	int n;
+	int i;
+
+	if (!PyArg_ParseTuple(args, "Oiii", &addrs, &th, &tl, &res)) {
+		return NULL;
+	}
+	seq = PySequence_Fast(addrs, "Addresses must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+	n = PySequence_Fast_GET_SIZE(seq);
+	roms = PyMem_Malloc(n * 8 + 1);
+	failed = PyMem_Malloc(n * sizeof(int) + 1);
+	l = NULL;
+	if (roms == NULL || failed == NULL) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (parse_addr(PySequence_Fast_GET_ITEM(seq, i), &addr) < 0 || addr == NULL) {
+			PyErr_SetString(PyExc_ValueError, "Address must be 8 bytes long");
+			goto out;
+		}
+		memcpy(roms[i], addr, 8);
+	}
+	ds18b20_verify(self->dev, roms, n, th, tl, res, failed);
+	if ((l = PyList_New(0)) == NULL) {
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (failed[i]) {
+			PyList_Append(l, PySequence_Fast_GET_ITEM(seq, i));
+		}
+	}
+ out:
+	PyMem_Free(roms);
+	PyMem_Free(failed);
+	Py_DECREF(seq);
+	return l;
+}
+
+static PyObject *
+ow_read_scratchpads(OwUsbObject *self, PyObject *args)
+{
+	PyObject *addrs;
+	PyObject *seq;
+	PyObject *l;
+	PyObject *o;
+	const uint8_t *addr;
+	uint8_t sp[DS18B20_SCRATCHPAD_LEN];
+	int recall = 0;
+	int n;
+	int i;
+
+	if (!PyArg_ParseTuple(args, "O|i", &addrs, &recall)) {
+		return NULL;
+	}
+	seq = PySequence_Fast(addrs, "Addresses must be a sequence");
+	if (seq == NULL) {
+		return NULL;
+	}
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < n; i++) {
+		if (parse_addr(PySequence_Fast_GET_ITEM(seq, i), &addr) < 0 || addr == NULL) {
+			PyErr_SetString(PyExc_ValueError, "Address must be 8 bytes long");
+			Py_DECREF(seq);
+			return NULL;
+		}
+	}
+	if (recall) {
+		ds18b20_recall_e2(self->dev, NULL);
+	}
+	if ((l = PyList_New(n)) == NULL) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		parse_addr(PySequence_Fast_GET_ITEM(seq, i), &addr);
+		if (ds18b20_read_scratchpad(self->dev, addr, sp) == 0) {
+			o = PyString_FromStringAndSize((char *)sp, sizeof(sp));
+		} else {
+			Py_INCREF(Py_None);
+			o = Py_None;
+		}
+		PyList_SET_ITEM(l, i, o);
+	}
+	Py_DECREF(seq);
+	return l;
+}
+
+static PyObject *
+ow_acq_discover(OwUsbObject *self)
+{
+	owacq_t *a = get_acq(self);
+
+	if (a == NULL) {
+		return NULL;
+	}
+	return Py_BuildValue("i", owacq_discover(a));
+}
+
+static PyObject *
+ow_acq_cycle(OwUsbObject *self)
+{
+	owacq_t *a = get_acq(self);
+	int r;
+
+	if (a == NULL) {
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	r = owacq_cycle(a);
+	Py_END_ALLOW_THREADS
+	return Py_BuildValue("i", r);
+}
+
+static PyObject *
+ow_acq_window(OwUsbObject *self, PyObject *args)
+{
+	owacq_t *a = get_acq(self);
+	double seconds;
+
+	if (a == NULL || !PyArg_ParseTuple(args, "d", &seconds)) {
+		return NULL;
+	}
+	a->window = seconds > 0 ? seconds * 1e9 : 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+agg_values(const double *v, int n, unsigned long div)
+{
+	PyObject *t = PyTuple_New(n);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		PyTuple_SET_ITEM(t, i, PyFloat_FromDouble(v[i] / div));
+	}
+	return t;
+}
+
+/*
+ * Return the aggregates of all engine devices as a list of
+ * (address, start, count, min, max, mean, last) tuples, or None for
+ * devices without readings in the window.
+ */
+static PyObject *
+ow_acq_aggregates(OwUsbObject *self, PyObject *args)
+{
+	owacq_t *a = get_acq(self);
+	owacq_agg_t aggs[OWACQ_MAX_DEVS];
+	owacq_agg_t *g;
+	PyObject *l;
+	PyObject *o;
+	int completed = 1;
+	int n;
+	int i;
+
+	if (a == NULL || !PyArg_ParseTuple(args, "|i", &completed)) {
+		return NULL;
+	}
+	n = owacq_aggregates(a, aggs, OWACQ_MAX_DEVS, completed);
+	if ((l = PyList_New(n)) == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		g = &aggs[i];
+		if (g->count == 0) {
+			Py_INCREF(Py_None);
+			o = Py_None;
+		} else {
+			o = Py_BuildValue("(s#dkNNNN)", (char *)a->devs[i].addr, 8,
+					  g->start / 1e9, g->count,
+					  agg_values(g->min, g->nvalues, 1),
+					  agg_values(g->max, g->nvalues, 1),
+					  agg_values(g->sum, g->nvalues, g->count),
+					  agg_values(g->last, g->nvalues, 1));
+		}
+		PyList_SET_ITEM(l, i, o);
+	}
+	return l;
+}
+
 static PyObject *
 ow_searchiter(OwUsbObject *self, PyObject *args, PyObject *kwds)
 {
@@ -232,9 +635,21 @@ static PyMethodDef OwUsbObject_methods[] = {
 	{ "cmd", (PyCFunction)ow_cmd, METH_VARARGS, "Send a command" },
 	{ "reset", (PyCFunction)ow_reset, METH_NOARGS, "Send a reset pulse" },
 	{ "block_io", (PyCFunction)ow_block_io,  METH_KEYWORDS, "Block IO" },
+	{ "read_straight", (PyCFunction)ow_read_straight, METH_KEYWORDS, "Write a command and read a fixed number of bytes" },
+	{ "chain_search", (PyCFunction)ow_chain_search, METH_NOARGS, "Find DS28EA00 devices in chain order" },
 	{ "search_first", (PyCFunction)ow_search_first, METH_VARARGS, "Find first 1-wire device"},
 	{ "search_next", (PyCFunction)ow_search_next, METH_NOARGS, "Find next 1-wire device"},
 	{ "searchiter", (PyCFunction)ow_searchiter, METH_VARARGS },
+	{ "therm_write", (PyCFunction)ow_therm_write, METH_VARARGS, "Write TH, TL and resolution of one or all thermometers" },
+	{ "therm_copy", (PyCFunction)ow_therm_copy, METH_VARARGS, "Copy scratchpad to EEPROM of one or all thermometers" },
+	{ "therm_recall", (PyCFunction)ow_therm_recall, METH_VARARGS, "Recall EEPROM of one or all thermometers" },
+	{ "therm_verify", (PyCFunction)ow_therm_verify, METH_VARARGS, "Verify and fix thermometer configuration, return failing addresses" },
+	{ "read_scratchpads", (PyCFunction)ow_read_scratchpads, METH_VARARGS, "Read the scratchpads of a list of thermometers" },
+	{ "read_counters", (PyCFunction)ow_read_counters, METH_VARARGS, "Read the counters of a list of DS2423 devices" },
+	{ "acq_discover", (PyCFunction)ow_acq_discover, METH_NOARGS, "Add all supported devices to the acquisition engine" },
+	{ "acq_cycle", (PyCFunction)ow_acq_cycle, METH_NOARGS, "Run one acquisition cycle" },
+	{ "acq_window", (PyCFunction)ow_acq_window, METH_VARARGS, "Set the aggregation window in seconds, 0 to disable" },
+	{ "acq_aggregates", (PyCFunction)ow_acq_aggregates, METH_VARARGS, "Return the completed or current aggregates of all devices" },
 	{NULL}
 };
 
@@ -245,7 +660,7 @@ static PyTypeObject OwUsbType = {
     "owusb.OwUsb",                /*tp_name*/
     sizeof(OwUsbObject),       /*tp_basicsize*/
     0,                         /*tp_itemsize*/
-    0,                         /*tp_dealloc*/
+    (destructor)OwUsbObject_dealloc, /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
     0,                         /*tp_setattr*/
@@ -359,7 +774,69 @@ static PyTypeObject OwDevIterType = {
  * Module methods
  *****************************************************/
 
+static PyObject *
+owusb_adapters(PyObject *self)
+{
+	return Py_BuildValue("i", owusb_enumerate());
+}
+
+/* Format an 8 byte address as "crc.serial.family" */
+static PyObject *
+owusb_format_rom(PyObject *self, PyObject *args)
+{
+	const char *addr;
+	int addrlen;
+	char s[ROM_STRLEN + 1];
+
+	if (!PyArg_ParseTuple(args, "s#", &addr, &addrlen)) {
+		return NULL;
+	}
+	if (addrlen != 8) {
+		PyErr_SetString(PyExc_ValueError, "Address must be 8 bytes");
+		return NULL;
+	}
+	return PyString_FromStringAndSize(format_rom(s, (const uint8_t *)addr), ROM_STRLEN);
+}
+
+/* Parse a "crc.serial.family" string into a 64 bit key */
+static PyObject *
+owusb_parse_rom(PyObject *self, PyObject *args)
+{
+	const char *s;
+	uint64_t key;
+
+	if (!PyArg_ParseTuple(args, "s", &s)) {
+		return NULL;
+	}
+	if (parse_rom(s, &key) < 0) {
+		PyErr_SetString(PyExc_ValueError, "Not a ROM");
+		return NULL;
+	}
+	return PyLong_FromUnsignedLongLong(key);
+}
+
+/* The 64 bit key of an 8 byte address */
+static PyObject *
+owusb_rom_key(PyObject *self, PyObject *args)
+{
+	const char *addr;
+	int addrlen;
+
+	if (!PyArg_ParseTuple(args, "s#", &addr, &addrlen)) {
+		return NULL;
+	}
+	if (addrlen != 8) {
+		PyErr_SetString(PyExc_ValueError, "Address must be 8 bytes");
+		return NULL;
+	}
+	return PyLong_FromUnsignedLongLong(rom_key((const uint8_t *)addr));
+}
+
 static PyMethodDef module_methods[] = {
+	{ "adapters", (PyCFunction)owusb_adapters, METH_NOARGS, "Number of adapters, found without opening them" },
+	{ "format_rom", (PyCFunction)owusb_format_rom, METH_VARARGS, "Format an address as crc.serial.family" },
+	{ "parse_rom", (PyCFunction)owusb_parse_rom, METH_VARARGS, "Parse crc.serial.family into a 64 bit key" },
+	{ "rom_key", (PyCFunction)owusb_rom_key, METH_VARARGS, "64 bit key of an address" },
 	{ NULL }
 };
 
@@ -387,6 +864,4 @@ initowusb(void)
 	PyModule_AddObject(m, "OwUsb", (PyObject *)&OwUsbType);
 	Py_INCREF(&OwDevIterType);
 	PyModule_AddObject(m, "DevIter", (PyObject *)&OwDevIterType);
-
-	owusb_init();
 }
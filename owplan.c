@@ -0,0 +1,121 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Bus capacity report
+ *
+ * owplan [-b budget] [-n] [-w] [period_ms]
+ *   Find the devices on all adapters and report the bus time needed
+ *   to read them every period: utilisation, headroom and the cost of
+ *   each device. Unless -n is given, one cycle is run first so the
+ *   report uses measured costs rather than modelled ones. Devices
+ *   slowed down to fit within the budget are marked. With -w the
+ *   adapters are attached warm, without a reset if their mode is
+ *   already right.
+ */
+
+#include "ds2490.h"
+#include "acquire.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_ADAPTERS 16
+
+static const char *
+type_name(int type)
+{
+	return type == OWACQ_THERMOMETER ? "therm" : "counter";
+}
+
+static void
+print_report(int n, owacq_t *a, owacq_capacity_t *c, int r)
+{
+	owacq_dev_t *d;
+	uint64_t interval;
+	char rom[ROM_STRLEN + 1];
+	int i;
+
+	printf("adapter %d: period %.1f ms convert %.1f ms reads %.1f ms "
+	       "utilisation %.1f%% headroom %.1f%%",
+	       n, c->period / 1e6, c->convert / 1e6, c->reads / 1e6,
+	       c->utilisation * 100, c->headroom * 100);
+	if (r < 0) {
+		printf(" OVERLOADED\n");
+	} else {
+		printf(" degraded %d\n", c->degraded);
+	}
+	if (a->retries) {
+		printf("  retries %lu costing %.1f ms\n", a->retries, a->retry_time / 1e6);
+	}
+	for (i = 0; i < a->ndevs; i++) {
+		d = &a->devs[i];
+		interval = owacq_read_interval(a, i);
+		printf("  %s %-7s prio %3d cost %7.2f ms%s interval %8.1f ms share %5.1f%%",
+		       format_rom(rom, d->addr), type_name(d->type), d->priority, owacq_cost(a, i) / 1e6,
+		       d->cost ? "" : "*", interval / 1e6,
+		       interval ? 100.0 * owacq_cost(a, i) / interval : 0);
+		if (d->slowdown > 1) {
+			printf(" slowed x%d", d->slowdown);
+		}
+		if (d->slow) {
+			printf(" quarantined, health %.2f", d->health);
+		}
+		printf("\n");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static owacq_t acq[MAX_ADAPTERS];
+	owacq_capacity_t cap;
+	double budget = 0;
+	int measure = 1;
+	int warm = 0;
+	int period_ms = 1000;
+	uint64_t t;
+	int nwarm = 0;
+	int overloaded = 0;
+	int i, r;
+
+	while ((i = getopt(argc, argv, "b:nw")) != -1) {
+		switch (i) {
+		case 'b': budget = atof(optarg); break;
+		case 'n': measure = 0; break;
+		case 'w': warm = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-b budget] [-n] [-w] [period_ms]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) period_ms = atoi(argv[optind]);
+
+	t = monotonic_ns();
+	if ((i = owusb_attach_all(warm)) != 0) {
+		printf("Failed to initialize: %d\n", i);
+		return -1;
+	}
+	t = monotonic_ns() - t;
+	for (i = 0; i < owusb_dev_count; i++) {
+		nwarm += owusb_devs[i].warm;
+	}
+	printf("opened %d adapters in %.1f ms, %d without reset\n",
+	       owusb_dev_count, t / 1e6, nwarm);
+	for (i = 0; i < owusb_dev_count && i < MAX_ADAPTERS; i++) {
+		owacq_init(&acq[i], &owusb_devs[i]);
+		acq[i].period = period_ms * 1000000ULL;
+		acq[i].budget = budget;
+		owacq_discover(&acq[i]);
+		if (measure) {
+			owacq_cycle(&acq[i]);
+		}
+		r = owacq_plan(&acq[i], &cap);
+		print_report(i, &acq[i], &cap, r);
+		if (r < 0) {
+			overloaded = 1;
+		}
+	}
+	printf("* modelled cost, the device has not been read\n");
+	return overloaded;
+}
@@ -0,0 +1,515 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Collector
+ *
+ * owpoll [-f line|csv|bin] [-p period_ms] [-i dev=ms]... [-c cycles] [-w]
+ *        [-t topology]
+ *   Find the devices on all adapters and poll them on a time grid of
+ *   period_ms (default 1000), streaming every reading to stdout until
+ *   interrupted or cycles have run. dev is "therm", "counter" or a
+ *   ROM as crc.serial.family, and reads the matching devices every
+ *   ms instead of every period; the last matching -i wins. The grid
+ *   runs once per period, so ms must be at least period_ms. With -w
+ *   the adapters are attached warm. When the bus cannot keep up, the
+ *   devices of the lowest priority are slowed down, see owacq_plan().
+ *
+ *   With -t only the adapters and devices in the topology file are
+ *   polled, without searching first, see topo.h. The topology is then
+ *   verified against a search of each adapter, one at a time, on a
+ *   thread of its own, and differences are logged. The adapter is
+ *   taken off the grid between cycles while its bus is searched, so
+ *   it skips a few slots but the other adapters stay on time.
+ *
+ * Formats, with the time in ns since the epoch of when the value was
+ * taken, i.e. the start of the conversion for thermometers:
+ *
+ *   line  Line protocol, one point per reading:
+ *         temperature,adapter=0,rom=<rom> value=21.5625 <time>
+ *         counter,adapter=0,rom=<rom> a=10i,b=0i,rate_a=0.5,rate_b=0 <time>
+ *         Failed reads have a single status=<OWUSB_E*>i field.
+ *   csv   time,adapter,rom,type,status,value0,value1,value2,value3
+ *   bin   Fixed size records of struct owpoll_record in host byte
+ *         order, the ROM as the 64 bit key of rom_key().
+ *
+ * The readings are formatted on the acquisition thread into one of two
+ * buffers, and a writer thread writes the full one out, so a slow
+ * consumer does not hold up the bus. If the consumer falls behind by a
+ * whole buffer, readings are dropped and the count is logged.
+ */
+
+#include "ds2490.h"
+#include "grid.h"
+#include "log.h"
+#include "topo.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define OWPOLL_BUFSIZE (256 * 1024)
+#define OWPOLL_MAX_RECORD 256  /* Longest formatted reading */
+#define MAX_RATES 64
+
+enum {
+	FORMAT_LINE,
+	FORMAT_CSV,
+	FORMAT_BIN
+};
+
+struct owpoll_record {
+	uint64_t time;
+	uint64_t rom;
+	int32_t status;
+	uint16_t adapter;
+	uint16_t type;         /* OWACQ_THERMOMETER or OWACQ_COUNTER */
+	double value[OWACQ_MAX_VALUES];
+};
+
+/* Poll interval of a type of devices, or with a key of a single device */
+struct rate {
+	int type;
+	uint64_t key;
+	uint64_t interval;     /* ns */
+};
+
+struct outbuf {
+	char data[OWPOLL_BUFSIZE];
+	int len;
+};
+
+static owgrid_t grid;
+static owacq_t acq[OWGRID_MAX_ACQ];
+static struct rate rates[MAX_RATES];
+static int nrates;
+static int format = FORMAT_LINE;
+static int nengines;
+static owtopo_t topo;
+static int topo_map[OWGRID_MAX_ACQ];    /* Topology adapter of each engine */
+
+/* Verification, handed between the acquisition and verifier threads */
+static int verify_next = OWGRID_MAX_ACQ; /* Next engine to verify */
+static int verifying = -1;              /* Engine lent to the verifier */
+static int verified;                    /* The verifier is done with it */
+static pthread_mutex_t vlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vcond = PTHREAD_COND_INITIALIZER;
+
+static struct outbuf bufs[2];
+static struct outbuf *fill = &bufs[0];  /* Filled by the acquisition thread */
+static struct outbuf *ready;            /* Handed to the writer */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int done;
+static unsigned long dropped;
+static unsigned long reported;
+
+static int
+format_line(char *p, int adapter, owacq_dev_t *d, owacq_reading_t *r)
+{
+	char rom[ROM_STRLEN + 1];
+	const char *m = d->type == OWACQ_THERMOMETER ? "temperature" : "counter";
+	unsigned long long t = r->convert.wall;
+
+	format_rom(rom, d->addr);
+	if (r->status != 0) {
+		return sprintf(p, "%s,adapter=%d,rom=%s status=%di %llu\n",
+			       m, adapter, rom, r->status, t);
+	}
+	if (d->type == OWACQ_THERMOMETER) {
+		return sprintf(p, "%s,adapter=%d,rom=%s value=%.4f %llu\n",
+			       m, adapter, rom, r->value[0], t);
+	}
+	return sprintf(p, "%s,adapter=%d,rom=%s a=%.0fi,b=%.0fi,rate_a=%.6g,rate_b=%.6g %llu\n",
+		       m, adapter, rom, r->value[0], r->value[1], r->value[2], r->value[3], t);
+}
+
+static int
+format_csv(char *p, int adapter, owacq_dev_t *d, owacq_reading_t *r)
+{
+	char rom[ROM_STRLEN + 1];
+	int n, i;
+
+	n = sprintf(p, "%llu,%d,%s,%s,%d", (unsigned long long)r->convert.wall,
+		    adapter, format_rom(rom, d->addr),
+		    d->type == OWACQ_THERMOMETER ? "temperature" : "counter", r->status);
+	for (i = 0; i < OWACQ_MAX_VALUES; i++) {
+		if (r->status == 0 && i < r->nvalues) {
+			n += sprintf(p + n, ",%.6g", r->value[i]);
+		} else {
+			p[n++] = ',';
+		}
+	}
+	p[n++] = '\n';
+	return n;
+}
+
+static int
+format_bin(char *p, int adapter, owacq_dev_t *d, owacq_reading_t *r)
+{
+	struct owpoll_record rec;
+	int i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time = r->convert.wall;
+	rec.rom = rom_key(d->addr);
+	rec.status = r->status;
+	rec.adapter = adapter;
+	rec.type = d->type;
+	for (i = 0; r->status == 0 && i < r->nvalues; i++) {
+		rec.value[i] = r->value[i];
+	}
+	memcpy(p, &rec, sizeof(rec));
+	return sizeof(rec);
+}
+
+/*
+ * Hand the buffer being filled to the writer, unless it is still
+ * busy with the other one. Never blocks the acquisition thread.
+ */
+static void
+handoff(void)
+{
+	if (fill->len == 0 || pthread_mutex_trylock(&lock) != 0) {
+		return;
+	}
+	if (ready == NULL) {
+		ready = fill;
+		fill = fill == &bufs[0] ? &bufs[1] : &bufs[0];
+		fill->len = 0;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+publish(owacq_t *a, owacq_dev_t *d, void *arg)
+{
+	int adapter = (long)arg;
+	char *p;
+
+	if (fill->len + OWPOLL_MAX_RECORD > OWPOLL_BUFSIZE) {
+		handoff();
+		if (fill->len + OWPOLL_MAX_RECORD > OWPOLL_BUFSIZE) {
+			dropped++;
+			return;
+		}
+	}
+	p = fill->data + fill->len;
+	switch (format) {
+	case FORMAT_LINE: fill->len += format_line(p, adapter, d, &d->reading); break;
+	case FORMAT_CSV: fill->len += format_csv(p, adapter, d, &d->reading); break;
+	case FORMAT_BIN: fill->len += format_bin(p, adapter, d, &d->reading); break;
+	}
+}
+
+/*
+ * Lend the next engine to the verifier, taking it off the grid, or
+ * put it back once verified. Runs between cycles and never blocks the
+ * acquisition thread.
+ */
+static void
+verify_step(owgrid_t *g)
+{
+	int i;
+
+	if (verify_next >= nengines || pthread_mutex_trylock(&vlock) != 0) {
+		return;
+	}
+	if (verifying < 0) {
+		for (i = 0; i < g->nacq && g->acq[i] != &acq[verify_next]; i++)
+			;
+		g->acq[i] = g->acq[--g->nacq];
+		verifying = verify_next;
+		verified = 0;
+		pthread_cond_signal(&vcond);
+		owlog(OWLOG_INFO, "adapter %s: not polled while verifying the topology",
+		      topo.adapters[topo_map[verifying]].path);
+	} else if (verified) {
+		g->acq[g->nacq++] = &acq[verifying];
+		verifying = -1;
+		verify_next++;
+	}
+	pthread_mutex_unlock(&vlock);
+}
+
+/* Search the bus of each lent engine and compare it with the topology */
+static void *
+verifier(void *arg)
+{
+	int i, r;
+
+	pthread_mutex_lock(&vlock);
+	while (1) {
+		while ((verifying < 0 || verified) && !done) {
+			pthread_cond_wait(&vcond, &vlock);
+		}
+		if (done) {
+			break;
+		}
+		i = verifying;
+		pthread_mutex_unlock(&vlock);
+		r = owtopo_verify(&topo, topo_map[i], &acq[i]);
+		owlog(r == 0 ? OWLOG_INFO : OWLOG_WARN, "adapter %s: topology verified, %ld differences",
+		      topo.adapters[topo_map[i]].path, r);
+		pthread_mutex_lock(&vlock);
+		verified = 1;
+	}
+	pthread_mutex_unlock(&vlock);
+	return NULL;
+}
+
+static void
+cycle(owgrid_t *g, void *arg)
+{
+	handoff();
+	verify_step(g);
+	if (dropped != reported) {
+		owlog(OWLOG_WARN, "output falling behind, %lu readings dropped", dropped - reported);
+		reported = dropped;
+	}
+}
+
+static int
+write_all(const char *p, int len)
+{
+	int n;
+
+	while (len > 0) {
+		if ((n = write(STDOUT_FILENO, p, len)) <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *
+writer(void *arg)
+{
+	struct outbuf *b;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (ready == NULL && !done) {
+			pthread_cond_wait(&cond, &lock);
+		}
+		if ((b = ready) == NULL) {
+			break;
+		}
+		pthread_mutex_unlock(&lock);
+		if (write_all(b->data, b->len) < 0) {
+			owlog(OWLOG_ERR, "output closed, stopping");
+			owgrid_stop(&grid);
+		}
+		pthread_mutex_lock(&lock);
+		b->len = 0;
+		ready = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void
+stop(int sig)
+{
+	owgrid_stop(&grid);
+}
+
+/* Parse dev=ms */
+static int
+parse_rate(const char *s)
+{
+	struct rate *r = &rates[nrates];
+	char dev[64];
+	const char *eq = strchr(s, '=');
+
+	if (eq == NULL || eq - s >= sizeof(dev) || nrates >= MAX_RATES) {
+		return -1;
+	}
+	memcpy(dev, s, eq - s);
+	dev[eq - s] = '\0';
+	r->type = 0;
+	r->key = 0;
+	if (strcmp(dev, "therm") == 0) {
+		r->type = OWACQ_THERMOMETER;
+	} else if (strcmp(dev, "counter") == 0) {
+		r->type = OWACQ_COUNTER;
+	} else if (parse_rom(dev, &r->key) < 0) {
+		return -1;
+	}
+	r->interval = atoi(eq + 1) * 1000000ULL;
+	nrates++;
+	return 0;
+}
+
+static void
+apply_rates(owacq_t *a)
+{
+	owacq_dev_t *d;
+	int i, j;
+
+	for (i = 0; i < a->ndevs; i++) {
+		d = &a->devs[i];
+		for (j = nrates - 1; j >= 0; j--) {
+			if (rates[j].type == d->type || rates[j].key == rom_key(d->addr)) {
+				owacq_set_adaptive(a, i, rates[j].interval, rates[j].interval, 0);
+				break;
+			}
+		}
+	}
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-f line|csv|bin] [-p period_ms] [-i dev=ms]... "
+		"[-c cycles] [-w] [-t topology]\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t w, v;
+	const char *topo_file = NULL;
+	owusb_device_t *dev;
+	int period_ms = 1000;
+	int cycles = 0;
+	int warm = 0;
+	int i, r;
+
+	while ((i = getopt(argc, argv, "f:p:i:c:wt:")) != -1) {
+		switch (i) {
+		case 'f':
+			if (strcmp(optarg, "line") == 0) format = FORMAT_LINE;
+			else if (strcmp(optarg, "csv") == 0) format = FORMAT_CSV;
+			else if (strcmp(optarg, "bin") == 0) format = FORMAT_BIN;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p': period_ms = atoi(optarg); break;
+		case 'i':
+			if (parse_rate(optarg) < 0) {
+				fprintf(stderr, "Bad rate %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'c': cycles = atoi(optarg); break;
+		case 'w': warm = 1; break;
+		case 't': topo_file = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (period_ms <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = 0; i < nrates; i++) {
+		if (rates[i].interval < period_ms * 1000000ULL) {
+			fprintf(stderr, "Interval %llu ms is shorter than the period\n",
+				(unsigned long long)rates[i].interval / 1000000);
+			return 1;
+		}
+	}
+
+	if (topo_file && owtopo_load(&topo, topo_file) < 0) {
+		fprintf(stderr, "%s:%d: %s\n", topo_file, topo.line, topo.error);
+		return 1;
+	}
+	for (i = 0; i < topo.nadapters; i++) {
+		for (r = 0; r < topo.adapters[i].ndevs; r++) {
+			if (topo.adapters[i].devs[r].interval &&
+			    topo.adapters[i].devs[r].interval < period_ms * 1000000ULL) {
+				fprintf(stderr, "%s: interval of a device on %s is shorter than the period\n",
+					topo_file, topo.adapters[i].path);
+				return 1;
+			}
+		}
+	}
+
+	owlog_start(STDERR_FILENO, OWLOG_INFO);
+	owgrid_init(&grid, period_ms * 1000000ULL);
+	grid.cycles = cycles;
+	grid.cycle = cycle;
+	if (topo_file) {
+		/* Open only the adapters in the topology and skip the search */
+		for (i = 0; i < topo.nadapters && grid.nacq < OWGRID_MAX_ACQ; i++) {
+			if ((r = owusb_find(topo.adapters[i].path)) < 0 ||
+			    (dev = owusb_attach(r, warm)) == NULL) {
+				owlog(OWLOG_ERR, "adapter %s: not found", topo.adapters[i].path);
+				continue;
+			}
+			owacq_init(&acq[grid.nacq], dev);
+			r = owtopo_apply(&topo, i, &acq[grid.nacq]);
+			owlog(OWLOG_INFO, "adapter %s: %ld devices from the topology",
+			      topo.adapters[i].path, r);
+			topo_map[grid.nacq] = i;
+			owgrid_add(&grid, &acq[grid.nacq]);
+		}
+		verify_next = 0;
+	} else {
+		if ((i = owusb_attach_all(warm)) != 0) {
+			owlog(OWLOG_ERR, "failed to initialize: %ld", i);
+			owlog_stop();
+			return 1;
+		}
+		for (i = 0; i < owusb_dev_count && i < OWGRID_MAX_ACQ; i++) {
+			owacq_init(&acq[i], &owusb_devs[i]);
+			r = owacq_discover(&acq[i]);
+			owlog(OWLOG_INFO, "adapter %ld: %ld devices", i, r);
+			owgrid_add(&grid, &acq[i]);
+		}
+	}
+	nengines = grid.nacq;
+	for (i = 0; i < nengines; i++) {
+		acq[i].publish = publish;
+		acq[i].arg = (void *)(long)i;
+		apply_rates(&acq[i]);
+		if ((r = owacq_plan(&acq[i], NULL)) < 0) {
+			owlog(OWLOG_WARN, "adapter %ld: the bus cannot keep up with a %ld ms period",
+			      i, period_ms);
+		} else if (r > 0) {
+			owlog(OWLOG_INFO, "adapter %ld: %ld devices slowed down to fit the period", i, r);
+		}
+	}
+	if (format == FORMAT_CSV) {
+		fill->len = sprintf(fill->data, "time,adapter,rom,type,status,value0,value1,value2,value3\n");
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	/* A closed output is seen as EPIPE by the writer */
+	signal(SIGPIPE, SIG_IGN);
+	pthread_create(&w, NULL, writer, NULL);
+	if (topo_file) {
+		pthread_create(&v, NULL, verifier, NULL);
+	}
+	if ((r = owgrid_start(&grid, NULL)) != 0) {
+		owlog(OWLOG_ERR, "failed to start acquisition thread: %ld", r);
+		owgrid_stop(&grid);
+	} else {
+		owgrid_join(&grid);
+	}
+
+	pthread_mutex_lock(&lock);
+	done = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(w, NULL);
+	if (topo_file) {
+		pthread_mutex_lock(&vlock);
+		pthread_cond_signal(&vcond);
+		pthread_mutex_unlock(&vlock);
+		pthread_join(v, NULL);
+	}
+	write_all(fill->data, fill->len);
+	owlog_stop();
+	return 0;
+}
@@ -0,0 +1,42 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static probes
+ *
+ * Built with OWUSB_USDT the probes below are USDT tracepoints of the
+ * provider owusb, from <sys/sdt.h> (systemtap-sdt-dev), which perf and
+ * bpftrace can attach to. A probe that is not attached is a single
+ * nop and its arguments are only loaded into registers. Without
+ * OWUSB_USDT the probes compile to nothing. See bpf/ for examples.
+ *
+ *   xfer_submit(adapter, ep, len)          USB transfer started
+ *   xfer_complete(adapter, ep, r)          Done, r bytes or < 0
+ *   status(adapter, len, flags, datain)    Status packet read from EP1
+ *   result(adapter, result)                Result codes, RESULT_*
+ *   search_step(adapter, len, rom)         Search step, rom if len >= 8
+ *   block_start(adapter, cmd, count, len)  1-Wire command started
+ *   block_end(adapter, cmd, count, r)      Done, r as returned
+ *   retry(adapter, error, tries, retried)  Failed attempt decided on
+ *
+ * adapter is the index in owusb_devs. ep is the endpoint, 1 for the
+ * status, 2 for bulk out and 3 for bulk in. cmd is the DS2490
+ * communication command, 0x74 for BLOCK I/O and 0x80 for READ
+ * STRAIGHT, and count the transactions of a batch, else 1. error is
+ * the OWACQ_ERR_* class of the failure.
+ */
+
+#ifdef OWUSB_USDT
+#include <sys/sdt.h>
+#define OWPROBE2(name, a, b) DTRACE_PROBE2(owusb, name, a, b)
+#define OWPROBE3(name, a, b, c) DTRACE_PROBE3(owusb, name, a, b, c)
+#define OWPROBE4(name, a, b, c, d) DTRACE_PROBE4(owusb, name, a, b, c, d)
+#else
+#define OWPROBE2(name, a, b) do { } while (0)
+#define OWPROBE3(name, a, b, c) do { } while (0)
+#define OWPROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
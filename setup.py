@@ -3,8 +3,8 @@
 from distutils.core import setup, Extension
 
 owusb = Extension('owusb',
-                  libraries = ['usb'],
-                  sources = ['ds2490.c', 'owmodule.c'])
+                  libraries = ['usb', 'pthread'],
+                  sources = ['ds2490.c', 'ds2423.c', 'ds28ea00.c', 'ds18b20.c', 'acquire.c', 'log.c', 'util.c', 'owmodule.c'])
 
 setup (name = '1-Wire',
        version = '1.0',
@@ -1,6 +1,8 @@
 /* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
 
 #include "ds2490.h"
+#include "acquire.h"
+#include "log.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
@@ -11,59 +13,53 @@
 int
 main(void)
 {
-	uint8_t owdevs[32][8];
-	int devcount;
+	static owacq_t acq;
 	owusb_device_t *dev;
-	int len, i;
-	uint8_t in[9];
-	uint8_t out[256];
+	owacq_reading_t *r;
+	int i;
 
 
-	if ((i = owusb_init()) != 0) {
-		printf("Failed to initialize: %d\n", i);
+	/* Diagnostics go to stderr without holding up the bus */
+	owlog_start(STDERR_FILENO, getenv("OWLOG_DEBUG") ? OWLOG_DEBUG : OWLOG_INFO);
+
+	/* Only the first adapter is used, leave the others alone */
+	if ((dev = owusb_open(0)) == NULL) {
+		printf("Failed to open adapter\n");
 		return -1;
 	}
-	dev = &owusb_devs[0];
-	/*len = owusb_search_all(dev, (uint8_t *)owdevs, 32 * 8);*/
-	len = owusb_search(dev, 0xf0, (uint8_t *)owdevs, 32 * 8);
-	devcount = len / 8;
-	for (i = 0; i < devcount; i++) {
-		print_addr((uint8_t *)owdevs[i]);
+	owacq_init(&acq, dev);
+	owacq_discover(&acq);
+	acq.period = 60 * 1000000000ULL;
+	if (owacq_plan(&acq, NULL) < 0) {
+		owlog(OWLOG_WARN, "the bus cannot keep up with a 60 s period");
+	}
+	for (i = 0; i < acq.ndevs; i++) {
+		print_addr(acq.devs[i].addr);
 	}
 	printf("\n");
-#if 0
-	memset(out, 0, 16);
-	out[0] = 0x05;
-	owusb_write(dev, out, 8);
-	owusb_com_search_access(dev,  PARAM_NTF|PARAM_IM | PARAM_RST | PARAM_F, 1, 1, 1, 0xf0);
-	sleep(1);
-	owusb_interrupt_read(dev);
-	owusb_print_state(dev);
-	owusb_read(dev, out, 16);
-	print_hex(out, 16);
-	return 0;
-#endif	
 	while (1) {
-		owusb_com_reset(dev, PARAM_IM, 0, 0);
-		owusb_write_byte(dev, 0xcc);
-		owusb_write_byte(dev, 0x44);
-		while (owusb_read_bit(dev) == 0);
-		for (i = 0; i < devcount; i++) {
-			if (owdevs[i][0] != 0x28) continue;
-			out[0] = 0x55;
-			memcpy(&out[1], owdevs[i], 8);
-			out[9] = 0xbe;
-			if (owusb_block_io(dev, out, 10, in, 9, 1, 0) != 0) {
-				exit(1);
+		if ((i = owacq_cycle(&acq)) < 0) {
+			/* Retries did not help, try again next cycle */
+			owlog(OWLOG_ERR, "cycle failed: %ld", i);
+			sleep(60);
+			continue;
+		}
+		/* Time of the conversion the temperatures represent */
+		printf("%.3f", acq.convert.wall / 1e9);
+		for (i = 0; i < acq.ndevs; i++) {
+			if (acq.devs[i].type != OWACQ_THERMOMETER) continue;
+			r = &acq.devs[i].reading;
+			if (r->status == 0) {
+				printf("\t%.4f", r->value[0]);
+			} else {
+				printf("\t-");
 			}
-			/*print_hex(in, 9);*/
-			printf("%.4f\t", convert_temp(in));
+		}
+		if (acq.cycle_retries) {
+			printf("\t(%d retries, %.1f ms)", acq.cycle_retries,
+			       acq.cycle_retry_time / 1e6);
 		}
 		printf("\n");
 		sleep(60);
 	}
-
-	/*crc = calc_crc8(data, 7);
-	  printf("CRC: %02x\n",  crc);*/
-
 }
@@ -0,0 +1,265 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+/*
+ * Static topology, see topo.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ds2490.h"
+#include "log.h"
+#include "topo.h"
+#include "util.h"
+
+#define OWTOPO_LINE 256
+
+static int
+owtopo_fail(owtopo_t *t, int line, const char *msg, const char *arg)
+{
+	t->line = line;
+	snprintf(t->error, sizeof(t->error), "%s%s%s", msg, arg ? " " : "", arg ? arg : "");
+	return -1;
+}
+
+static int
+owtopo_rom(const char *s, uint8_t *addr)
+{
+	uint64_t key;
+
+	if (s == NULL || parse_rom(s, &key) < 0) {
+		return -1;
+	}
+	rom_addr(key, addr);
+	return calc_crc8(addr, 8) == 0 ? 0 : -1;
+}
+
+static int
+owtopo_speed(const char *s)
+{
+	if (s == NULL) return -1;
+	if (strcmp(s, "regular") == 0) return PARAM_SPEED_REGULAR;
+	if (strcmp(s, "flexible") == 0) return PARAM_SPEED_FLEXIBLE;
+	/*
+	 * Not overdrive: the devices would have to be put into overdrive
+	 * first, and the DS18B20 has no overdrive at all.
+	 */
+	return -1;
+}
+
+/* Parse the options of an adapter line */
+static int
+owtopo_adapter(owtopo_t *t, int line, char **save)
+{
+	owtopo_adapter_t *ad;
+	char *tok;
+
+	if (t->nadapters >= OWTOPO_MAX_ADAPTERS) {
+		return owtopo_fail(t, line, "too many adapters", NULL);
+	}
+	ad = &t->adapters[t->nadapters];
+	memset(ad, 0, sizeof(*ad));
+	if ((tok = strtok_r(NULL, " \t\n", save)) == NULL ||
+	    strlen(tok) >= sizeof(ad->path) || strchr(tok, '/') == NULL) {
+		return owtopo_fail(t, line, "expected adapter bus/device", NULL);
+	}
+	strcpy(ad->path, tok);
+	ad->speed = PARAM_SPEED_REGULAR;
+	while ((tok = strtok_r(NULL, " \t\n", save)) != NULL) {
+		if (strcmp(tok, "speed") == 0) {
+			if ((ad->speed = owtopo_speed(strtok_r(NULL, " \t\n", save))) < 0) {
+				return owtopo_fail(t, line, "expected regular or flexible after speed", NULL);
+			}
+		} else {
+			return owtopo_fail(t, line, "unknown option", tok);
+		}
+	}
+	t->nadapters++;
+	return 0;
+}
+
+/* Parse the ROM and options of a device line */
+static int
+owtopo_device(owtopo_t *t, int line, char **save)
+{
+	owtopo_adapter_t *ad;
+	owtopo_dev_t *d;
+	char *tok, *arg;
+
+	if (t->nadapters == 0) {
+		return owtopo_fail(t, line, "device before the first adapter", NULL);
+	}
+	ad = &t->adapters[t->nadapters - 1];
+	if (ad->ndevs >= OWACQ_MAX_DEVS) {
+		return owtopo_fail(t, line, "too many devices", NULL);
+	}
+	d = &ad->devs[ad->ndevs];
+	memset(d, 0, sizeof(*d));
+	tok = strtok_r(NULL, " \t\n", save);
+	if (owtopo_rom(tok, d->addr) < 0) {
+		return owtopo_fail(t, line, "bad ROM", tok);
+	}
+	while ((tok = strtok_r(NULL, " \t\n", save)) != NULL) {
+		arg = strtok_r(NULL, " \t\n", save);
+		if (strcmp(tok, "interval") == 0 && arg) {
+			d->interval = strtoull(arg, NULL, 10) * 1000000ULL;
+		} else if (strcmp(tok, "priority") == 0 && arg) {
+			d->priority = atoi(arg);
+		} else if (strcmp(tok, "coupler") == 0 && owtopo_rom(arg, d->coupler) == 0) {
+			arg = strtok_r(NULL, " \t\n", save);
+			if (arg && strcmp(arg, "main") == 0) {
+				d->branch = OWTOPO_MAIN;
+			} else if (arg && strcmp(arg, "aux") == 0) {
+				d->branch = OWTOPO_AUX;
+			} else {
+				return owtopo_fail(t, line, "expected main or aux after coupler", NULL);
+			}
+		} else {
+			return owtopo_fail(t, line, "bad option", tok);
+		}
+	}
+	ad->ndevs++;
+	return 0;
+}
+
+/*
+ * Load a topology file.
+ *
+ * Returns: 0 on success, -1 on failure with the reason and line in
+ * t->error and t->line
+ */
+int
+owtopo_load(owtopo_t *t, const char *file)
+{
+	char buf[OWTOPO_LINE];
+	char *tok, *save, *p;
+	FILE *f;
+	int line = 0;
+	int r = 0;
+
+	memset(t, 0, sizeof(*t));
+	if ((f = fopen(file, "r")) == NULL) {
+		return owtopo_fail(t, 0, "cannot open", file);
+	}
+	while (r == 0 && fgets(buf, sizeof(buf), f) != NULL) {
+		line++;
+		if ((p = strchr(buf, '#')) != NULL) {
+			*p = '\0';
+		}
+		if ((tok = strtok_r(buf, " \t\n", &save)) == NULL) {
+			continue;
+		}
+		if (strcmp(tok, "adapter") == 0) {
+			r = owtopo_adapter(t, line, &save);
+		} else if (strcmp(tok, "device") == 0) {
+			r = owtopo_device(t, line, &save);
+		} else {
+			r = owtopo_fail(t, line, "unknown keyword", tok);
+		}
+	}
+	fclose(f);
+	return r;
+}
+
+/*
+ * Add the devices of adapter i of the topology to an engine, instead
+ * of owacq_discover(), and set the speed of the adapter.
+ *
+ * The engine cannot switch DS2409 branches, so devices behind a
+ * coupler are left out and logged.
+ *
+ * Returns: number of devices added
+ */
+int
+owtopo_apply(owtopo_t *t, int i, owacq_t *a)
+{
+	owtopo_adapter_t *ad = &t->adapters[i];
+	owtopo_dev_t *d;
+	int j, k;
+	int n = 0;
+
+	a->speed = ad->speed;
+	if (ad->speed != PARAM_SPEED_REGULAR) {
+		owusb_mod_speed(a->dev, ad->speed);
+	}
+	for (j = 0; j < ad->ndevs; j++) {
+		d = &ad->devs[j];
+		if (d->branch) {
+			owlog(OWLOG_WARN, "adapter %s: device %016llx is behind coupler %016llx, not polled",
+			      ad->path, rom_key(d->addr), rom_key(d->coupler));
+			continue;
+		}
+		if ((k = owacq_add(a, d->addr)) < 0) {
+			owlog(OWLOG_WARN, "adapter %s: device %016llx not supported",
+			      ad->path, rom_key(d->addr));
+			continue;
+		}
+		a->devs[k].priority = d->priority;
+		if (d->interval) {
+			owacq_set_adaptive(a, k, d->interval, d->interval, 0);
+		}
+		n++;
+	}
+	return n;
+}
+
+/* A configured device, or a coupler devices are configured behind */
+static int
+owtopo_known(owtopo_adapter_t *ad, const uint8_t *addr)
+{
+	int j;
+
+	for (j = 0; j < ad->ndevs; j++) {
+		if (memcmp(ad->devs[j].addr, addr, 8) == 0 ||
+		    (ad->devs[j].branch && memcmp(ad->devs[j].coupler, addr, 8) == 0)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compare adapter i of the topology with a search of its bus, logging
+ * configured devices that are missing and devices found that are not
+ * configured. The search holds the bus, so the engine a must not be on
+ * a grid while it runs. As long as it is not, this may be called from
+ * any thread.
+ *
+ * Returns: number of differences, < 0 if the search failed
+ */
+int
+owtopo_verify(owtopo_t *t, int i, owacq_t *a)
+{
+	owtopo_adapter_t *ad = &t->adapters[i];
+	uint8_t roms[OWACQ_MAX_DEVS][8];
+	int len, n;
+	int j, k;
+
+	len = owusb_search(a->dev, WIRE_CMD_SEARCH_ROM, (uint8_t *)roms, sizeof(roms));
+	if (len < 0) {
+		return len;
+	}
+	n = len / 8;
+	ad->missing = ad->unknown = 0;
+	for (j = 0; j < ad->ndevs; j++) {
+		if (ad->devs[j].branch) {
+			continue;
+		}
+		for (k = 0; k < n && memcmp(roms[k], ad->devs[j].addr, 8) != 0; k++)
+			;
+		if (k == n) {
+			ad->missing++;
+			owlog(OWLOG_WARN, "adapter %s: configured device %016llx not found",
+			      ad->path, rom_key(ad->devs[j].addr));
+		}
+	}
+	for (k = 0; k < n; k++) {
+		if (!owtopo_known(ad, roms[k])) {
+			ad->unknown++;
+			owlog(OWLOG_WARN, "adapter %s: found device %016llx not in the topology",
+			      ad->path, rom_key(roms[k]));
+		}
+	}
+	ad->verified = 1;
+	return ad->missing + ad->unknown;
+}
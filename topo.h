@@ -0,0 +1,64 @@
+/* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
+
+#ifndef TOPO_H
+#define TOPO_H
+
+#include <stdint.h>
+#include "acquire.h"
+
+/*
+ * Static topology
+ *
+ * A topology file lists the adapters and the devices on each, so a
+ * collector can build its poll plan without searching the buses:
+ *
+ *   # comment
+ *   adapter <bus>/<device> [speed regular|flexible]
+ *   device <crc.serial.family> [interval <ms>] [priority <n>]
+ *          [coupler <crc.serial.family> main|aux]
+ *
+ * Devices belong to the adapter above them. The family code of the
+ * ROM gives the type of the device. Without an interval the device is
+ * read every cycle. A coupler names the DS2409 branch the device is
+ * on.
+ */
+
+#ifndef OWTOPO_MAX_ADAPTERS
+#define OWTOPO_MAX_ADAPTERS 16
+#endif
+
+enum {
+	OWTOPO_MAIN = 1,       /* Main branch of a DS2409 */
+	OWTOPO_AUX = 2         /* Auxiliary branch */
+};
+
+typedef struct owtopo_dev {
+	uint8_t addr[8];
+	uint64_t interval;     /* ns, 0 for every cycle */
+	int priority;
+	uint8_t coupler[8];    /* DS2409 the device is behind */
+	int branch;            /* OWTOPO_MAIN, OWTOPO_AUX or 0 for none */
+} owtopo_dev_t;
+
+typedef struct owtopo_adapter {
+	char path[32];         /* USB path as for owusb_find() */
+	int speed;             /* PARAM_SPEED_* */
+	int ndevs;
+	owtopo_dev_t devs[OWACQ_MAX_DEVS];
+	int verified;          /* Compared with a search */
+	int missing;           /* Configured devices not found */
+	int unknown;           /* Devices found but not configured */
+} owtopo_adapter_t;
+
+typedef struct owtopo {
+	int nadapters;
+	owtopo_adapter_t adapters[OWTOPO_MAX_ADAPTERS];
+	int line;              /* Line of the first error */
+	char error[80];
+} owtopo_t;
+
+int owtopo_load(owtopo_t *t, const char *file);
+int owtopo_apply(owtopo_t *t, int i, owacq_t *a);
+int owtopo_verify(owtopo_t *t, int i, owacq_t *a);
+
+#endif
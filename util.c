@@ -1,31 +1,171 @@
 /* Copyright (C) Bjorn Andersson <bjorn@iki.fi> */
 
+#ifndef OWUSB_NO_STDIO
 #include <stdio.h>
+#endif
+#include <time.h>
 #include "util.h"
 
+static const char hex_digits[16] = "0123456789abcdef";
+
+/* Two hex digits of a byte, without a NUL */
+static char *
+hex_byte(char *out, uint8_t b)
+{
+	out[0] = hex_digits[b >> 4];
+	out[1] = hex_digits[b & 0xf];
+	return out + 2;
+}
+
+/*
+ * Hex encode len bytes into out, which must hold 2 * len + 1 chars.
+ *
+ * Returns: out
+ */
+char *
+format_hex(char *out, const uint8_t *data, int len)
+{
+	char *p = out;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		p = hex_byte(p, data[i]);
+	}
+	*p = '\0';
+	return out;
+}
+
+/*
+ * Format a ROM as "crc.serial.family", with the serial number most
+ * significant byte first, e.g. "2f.000001a2b3c4.28". out must hold
+ * ROM_STRLEN + 1 chars.
+ *
+ * Returns: out
+ */
+char *
+format_rom(char *out, const uint8_t *addr)
+{
+	char *p = out;
+	int i;
+
+	p = hex_byte(p, addr[7]);
+	*p++ = '.';
+	for (i = 6; i >= 1; i--) {
+		p = hex_byte(p, addr[i]);
+	}
+	*p++ = '.';
+	p = hex_byte(p, addr[0]);
+	*p = '\0';
+	return out;
+}
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Parse a ROM in the format of format_rom() into a 64 bit key, with
+ * the family code in the least significant byte as in rom_key(). The
+ * CRC is not checked.
+ *
+ * Returns: 0 on success, -1 if s is not a ROM
+ */
+int
+parse_rom(const char *s, uint64_t *key)
+{
+	/* Byte of the ROM at each pair of digits, -1 at the dots */
+	static const signed char pos[] = { 7, -1, 6, 5, 4, 3, 2, 1, -1, 0 };
+	uint64_t k = 0;
+	int hi, lo;
+	int i;
+
+	for (i = 0; i < sizeof(pos); i++) {
+		if (pos[i] < 0) {
+			if (*s++ != '.') {
+				return -1;
+			}
+			continue;
+		}
+		if ((hi = hex_value(s[0])) < 0 || (lo = hex_value(s[1])) < 0) {
+			return -1;
+		}
+		k |= (uint64_t)(hi << 4 | lo) << (8 * pos[i]);
+		s += 2;
+	}
+	if (*s != '\0') {
+		return -1;
+	}
+	*key = k;
+	return 0;
+}
+
+/* The ROM as a 64 bit integer, for use as a key */
+uint64_t
+rom_key(const uint8_t *addr)
+{
+	uint64_t k = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		k = k << 8 | addr[i];
+	}
+	return k;
+}
+
+void
+rom_addr(uint64_t key, uint8_t *addr)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		addr[i] = key >> (8 * i);
+	}
+}
+
+#ifndef OWUSB_NO_STDIO
 void
 print_hex(uint8_t *data, int len)
 {
+	char line[8 * 3 + 2];
+	char *p = line;
 	int i;
 
+	/* Eight bytes per line */
 	for (i = 0; i < len; i++) {
-		printf("%02x ", data[i]);
-		if (i + 1 < len && (i + 1) % 8 == 0) {
-			printf("\n");
+		p = hex_byte(p, data[i]);
+		*p++ = ' ';
+		if ((i + 1) % 8 == 0 || i + 1 == len) {
+			*p++ = '\n';
+			*p = '\0';
+			fputs(line, stdout);
+			p = line;
 		}
 	}
-	printf("\n");
+	if (len == 0) {
+		putchar('\n');
+	}
 }
 
 void
 print_addr(uint8_t *addr) {
+	char line[8 * 3 + 2];
+	char *p = line;
 	int i;
 
 	for (i = 7; i >= 0; i--) {
-		printf("%02x ", addr[i]);
+		p = hex_byte(p, addr[i]);
+		*p++ = ' ';
 	}
-	printf("\n");
+	*p++ = '\n';
+	*p = '\0';
+	fputs(line, stdout);
 }
+#endif
 
 float
 convert_temp(uint8_t *temp)
@@ -36,7 +176,7 @@ convert_temp(uint8_t *temp)
 }
 
 
-static uint8_t crc8[256] = {
+static const uint8_t crc8[256] = {
 	0x00, 0x5e, 0xbc, 0xe2, 0x61, 0x3f, 0xdd, 0x83,
 	0xc2, 0x9c, 0x7e, 0x20, 0xa3, 0xfd, 0x1f, 0x41,
 	0x9d, 0xc3, 0x21, 0x7f, 0xfc, 0xa2, 0x40, 0x1e,
@@ -82,6 +222,69 @@ calc_crc8(uint8_t *data, int len) {
 	return crc;
 }
 
+static const uint16_t crc16[256] = {
+	0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
+	0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
+	0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
+	0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
+	0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
+	0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
+	0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
+	0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
+	0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
+	0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
+	0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
+	0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
+	0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
+	0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
+	0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
+	0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
+	0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
+	0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
+	0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
+	0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
+	0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
+	0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
+	0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
+	0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
+	0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
+	0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
+	0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
+	0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
+	0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
+	0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
+	0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
+	0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
+};
+
+/*
+ * 1-Wire CRC16 as used by the DS2423 and other memory devices. The
+ * device sends the inverted CRC, so running this over the data and
+ * the two received CRC bytes yields 0xb001 on success.
+ */
+uint16_t
+calc_crc16(uint8_t *data, int len)
+{
+	uint16_t crc;
+	int i;
+
+	for (i = 0, crc = 0; i < len; i++) {
+		crc = (crc >> 8) ^ crc16[(crc ^ data[i]) & 0xff];
+	}
+	return crc;
+}
+
+/* Monotonic clock in nanoseconds */
+uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifndef OWUSB_NO_STDIO
 void
 print_hex16(void)
 {
@@ -95,5 +298,4 @@ print_hex16(void)
 	}
 	printf("\n");
 }
-
-
+#endif
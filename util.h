@@ -2,7 +2,19 @@
 
 #include <stdint.h>
 
+/* Length of a ROM in the "crc.serial.family" format, without the NUL */
+#define ROM_STRLEN 18
+
+/* Not available when built with OWUSB_NO_STDIO */
 void print_hex(uint8_t *data, int len);
 void print_addr(uint8_t *addr);
+
+char *format_hex(char *out, const uint8_t *data, int len);
+char *format_rom(char *out, const uint8_t *addr);
+int parse_rom(const char *s, uint64_t *key);
+uint64_t rom_key(const uint8_t *addr);
+void rom_addr(uint64_t key, uint8_t *addr);
 uint8_t calc_crc8(uint8_t *data, int len);
+uint16_t calc_crc16(uint8_t *data, int len);
 float convert_temp(uint8_t *temp);
+uint64_t monotonic_ns(void);